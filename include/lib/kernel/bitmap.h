@@ -13,6 +13,11 @@ struct bitmap *bitmap_create_in_buf (size_t bit_cnt, void *, size_t byte_cnt);
 size_t bitmap_buf_size (size_t bit_cnt);
 void bitmap_destroy (struct bitmap *);
 
+/* Summary of full elements, for faster searches for false bits. */
+size_t bitmap_summary_size (size_t bit_cnt);
+void bitmap_add_summary (struct bitmap *, void *, size_t byte_cnt);
+void bitmap_rebuild_summary (struct bitmap *);
+
 /* Bitmap size. */
 size_t bitmap_size (const struct bitmap *);
 
@@ -36,6 +36,24 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Virtual memory extensions. */
+	SYS_MADVISE,                /* Advise on the use of memory. */
+	SYS_MSYNC,                  /* Write back a memory mapping. */
+};
+
+/* Flags for mmap. */
+enum {
+	MAP_POPULATE = 1 << 1,      /* Read in the whole mapping right away. */
+};
+
+/* Advice for SYS_MADVISE. */
+enum {
+	MADV_NORMAL,                /* No special treatment. */
+	MADV_RANDOM,                /* Expect random access: no read ahead. */
+	MADV_SEQUENTIAL,            /* Expect sequential access: read ahead more. */
+	MADV_WILLNEED,              /* Expect access soon: read in now. */
+	MADV_DONTNEED,              /* Do not expect access: drop the pages. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -1,6 +1,7 @@
 #ifndef THREADS_PALLOC_H
 #define THREADS_PALLOC_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -11,13 +12,24 @@ enum palloc_flags {
 	PAL_USER = 004              /* User page. */
 };
 
+struct bitmap;
+
 /* Maximum number of pages to put in user pool. */
 extern size_t user_page_limit;
 
 uint64_t palloc_init (void);
 void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
+void *palloc_get_large (enum palloc_flags);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+bool palloc_prezero_page (void);
+void palloc_print_stats (void);
+
+/* Compaction and reclaim support. */
+size_t palloc_user_page_cnt (void);
+size_t palloc_user_free_cnt (void);
+size_t palloc_user_page_idx (const void *);
+void *palloc_claim_user_range (size_t page_cnt, const struct bitmap *movable);
 
 #endif /* threads/palloc.h */
@@ -1,13 +1,23 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
+#include <stddef.h>
 #include "vm/vm.h"
 struct page;
 enum vm_type;
 
+struct zswap_entry;
+
 struct anon_page {
+	enum vm_type type;          /* VM_ANON and its markers. */
+	size_t slot;                /* Swap slot, or BITMAP_ERROR if none. */
+	struct zswap_entry *zentry; /* Compressed copy in zswap, or null. */
 };
 
 void vm_anon_init (void);
+void anon_print_stats (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void anon_release_swap (struct page *page);
+void anon_readahead_feedback (bool hit);
+bool anon_swap_write (struct page *page, const void *data);
 
 #endif
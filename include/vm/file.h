@@ -1,5 +1,6 @@
 #ifndef VM_FILE_H
 #define VM_FILE_H
+#include <stddef.h>
 #include "filesys/file.h"
 #include "vm/vm.h"
 
@@ -7,11 +8,29 @@ struct page;
 enum vm_type;
 
 struct file_page {
+	struct file *file;          /* Private reopened copy of the file. */
+	off_t ofs;                  /* Offset of the page in FILE. */
+	size_t read_bytes;          /* Bytes to read; the rest is zeros. */
+	enum vm_type type;          /* Type and markers it was created with. */
 };
 
+struct frame;
+struct fcache_entry;
+struct supplemental_page_table;
+
 void vm_file_init (void);
+void file_print_stats (void);
 bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
-void *do_mmap(void *addr, size_t length, int writable,
+bool file_lazy_load (struct page *page, void *aux);
+bool file_backed_adopt (struct page *page);
+bool file_page_write_back (struct page *page);
+void file_write_back_range (struct supplemental_page_table *spt, void *start,
+		void *end);
+struct frame *fcache_find (struct page *page);
+void fcache_hit (struct page *page);
+void fcache_add (struct frame *frame);
+void fcache_remove (struct frame *frame);
+void *do_mmap(void *addr, size_t length, bool writable, int flags,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
 #endif
@@ -1,12 +1,26 @@
 #ifndef VM_UNINIT_H
 #define VM_UNINIT_H
+#include <stddef.h>
 #include "vm/vm.h"
+#include "filesys/off_t.h"
 
 struct page;
 enum vm_type;
 
 typedef bool vm_initializer (struct page *, void *aux);
 
+/* AUX of an uninit page whose contents come from a file: READ_BYTES
+ * bytes of FILE starting at OFS, followed by zeros up to the end of
+ * the page.  The page owns this record and FILE, a private reopened
+ * copy; if the page is destroyed before it is ever loaded,
+ * uninit_destroy () frees them.  Every lazily initialized page in the
+ * kernel uses either this or a null AUX. */
+struct lazy_load {
+	struct file *file;
+	off_t ofs;
+	size_t read_bytes;
+};
+
 /* Uninitlialized page. The type for implementing the
  * "Lazy loading". */
 struct uninit_page {
@@ -1,6 +1,10 @@
 #ifndef VM_VM_H
 #define VM_VM_H
 #include <stdbool.h>
+#include <stdint.h>
+#include <hash.h>
+#include <list.h>
+#include <syscall-nr.h>
 #include "threads/palloc.h"
 
 enum vm_type {
@@ -19,6 +23,14 @@ enum vm_type {
 	 * markers, until the value is fit in the int. */
 	VM_MARKER_0 = (1 << 3),
 	VM_MARKER_1 = (1 << 4),
+	VM_MARKER_2 = (1 << 5),
+
+	/* Anonymous page that belongs to the user stack. */
+	VM_STACK = VM_MARKER_0,
+	/* File-backed page that starts an mmap () mapping. */
+	VM_MMAP_HEAD = VM_MARKER_1,
+	/* File-backed page of an executable's read-only segment. */
+	VM_SEGMENT = VM_MARKER_2,
 
 	/* DO NOT EXCEED THIS VALUE. */
 	VM_MARKER_END = (1 << 31),
@@ -46,6 +58,13 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
+	struct thread *owner;  /* Thread whose address space holds VA. */
+	bool writable;         /* May the user write to VA? */
+	bool write_protect;    /* Map read-only until the first write? */
+	bool ghost;            /* Evicted recently? */
+	struct list_elem ghost_elem;  /* Element in the ghost list. */
+	struct page *next_sharer;     /* Next page sharing FRAME, or null. */
+	uint8_t advice;        /* MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL. */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -59,12 +78,44 @@ struct page {
 	};
 };
 
-/* The representation of "frame" */
+/* The representation of "frame".  After fork, several pages may share
+ * one frame copy-on-write: PAGE is then the first of them, and the rest
+ * follow through their next_sharer links. */
 struct frame {
 	void *kva;
 	struct page *page;
+	size_t page_cnt;        /* # of pages sharing the frame. */
+	struct list_elem elem;  /* Element in the frame table. */
+	int pin_cnt;            /* # of holds against eviction or migration. */
+	bool io;                /* Being read or written without FRAME_LOCK? */
+	bool readahead;         /* Read ahead from swap, not mapped yet? */
+	struct fcache_entry *cache;  /* Entry in the file frame cache, or null. */
+	bool merged;            /* Shared by ksmd rather than by fork? */
+	bool in_ksm_tree;       /* In ksmd's tree of stable frames? */
+	uint64_t ksm_sum;       /* Checksum at ksmd's last visit. */
+	struct hash_elem ksm_elem;  /* Element in ksmd's tree. */
+	int queue;              /* 2Q queue holding the frame. */
+	struct list_elem q_elem;  /* Element in that queue. */
+	bool referenced;        /* Accessed bit cleared by the WSS sampler. */
+	struct thp *thp;        /* Huge page the frame is part of, or null. */
+};
+
+/* Frame replacement policies. */
+enum vm_policy {
+	VM_POLICY_CLOCK,       /* Second chance, preferring clean pages. */
+	VM_POLICY_2Q           /* Scan-resistant 2Q. */
 };
 
+extern enum vm_policy vm_policy;
+extern bool vm_ksm;
+extern bool vm_populate_all;
+extern size_t vm_rss_limit;
+extern bool vm_rss_auto;
+extern bool vm_thp;
+
+/* Number of sample periods the working-set estimate looks back. */
+#define WSS_WINDOW 4
+
 /* The function table for page operations.
  * This is one way of implementing "interface" in C.
  * Put the table of "method" into the struct's member, and
@@ -82,11 +133,26 @@ struct page_operations {
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
 /* Representation of current process's memory space.
- * We don't want to force you to obey any specific design for this struct.
- * All designs up to you for this. */
+ *
+ * A radix tree keyed by user virtual address, with one level per level
+ * of the x86-64 page table: the root is indexed by PML4 (), the next
+ * levels by PDPE () and PDX (), and the leaves by PTX () hold the
+ * struct page pointers.  Every node is one page of 512 slots, and
+ * missing subtrees are null, so a lookup costs four array indexings
+ * and a range walk skips empty 2 MB, 1 GB and 512 GB regions
+ * wholesale.  A leaf covers exactly the 2 MB that one page table
+ * covers, which lets range removal clear PTEs one page table at a
+ * time with pml4_clear_range (). */
 struct supplemental_page_table {
+	void *root;                 /* Root node, or null if empty. */
+	size_t rss;                 /* # of pages in memory. */
+	size_t ws_sample[WSS_WINDOW];  /* Pages accessed, per sample period. */
+	unsigned ws_epoch;          /* Period of the newest sample. */
 };
 
+/* Called for each page by spt_for_each (); return false to stop. */
+typedef bool spt_page_func (struct page *, void *aux);
+
 #include "threads/thread.h"
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
@@ -96,8 +162,23 @@ struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
+bool spt_for_each (struct supplemental_page_table *spt, void *start,
+		void *end, spt_page_func *func, void *aux);
+bool spt_range_empty (struct supplemental_page_table *spt, void *start,
+		void *end);
+void spt_remove_range (struct supplemental_page_table *spt, void *start,
+		void *end);
 
 void vm_init (void);
+void vm_print_stats (void);
+void *vm_compact (size_t page_cnt);
+void *vm_cache_page (struct page *page);
+void vm_cache_page_done (struct page *page);
+void vm_io_begin (void);
+void vm_io_end (void);
+int vm_madvise (void *addr, size_t length, int advice);
+int vm_msync (void *addr, size_t length);
+bool vm_populate (void *start, void *end);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
 
@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -23,10 +24,21 @@ typedef unsigned long elem_type;
 
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   Multi-bit operations work a whole element at a time.  A bitmap
+   may also carry a summary, with one bit per element that is set
+   when every bit of that element is true.  Searches for false bits
+   (free pages, free sectors, free swap slots) use it to step over
+   full regions ELEM_BITS elements at a time.  The summary is only a
+   hint in one direction: a set summary bit always means a full
+   element, but a full element may have a clear summary bit for a
+   moment.  Bitmaps with a summary update it with interrupts off, so
+   that an interrupt cannot break that rule. */
 struct bitmap {
 	size_t bit_cnt;     /* Number of bits. */
 	elem_type *bits;    /* Elements that represent bits. */
+	elem_type *summary; /* One bit per full element, or NULL. */
 };
 
 /* Returns the index of the element that contains the bit
@@ -63,6 +75,112 @@ last_mask (const struct bitmap *b) {
 	return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns the number of bits set in ELEM. */
+static inline size_t
+elem_popcount (elem_type elem) {
+	/* No libgcc in the kernel, so no __builtin_popcountl(). */
+	elem = elem - ((elem >> 1) & 0x5555555555555555UL);
+	elem = (elem & 0x3333333333333333UL) + ((elem >> 2) & 0x3333333333333333UL);
+	elem = (elem + (elem >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+	return (elem * 0x0101010101010101UL) >> 56;
+}
+
+/* Returns a mask of the bits of element ELEM_IDX that fall in the
+   bit range [START, END). */
+static inline elem_type
+range_mask (size_t elem_idx, size_t start, size_t end) {
+	size_t lo = elem_idx * ELEM_BITS;
+	elem_type mask = (elem_type) -1;
+
+	if (start > lo)
+		mask &= (elem_type) -1 << (start - lo);
+	if (end < lo + ELEM_BITS)
+		mask &= ((elem_type) 1 << (end - lo)) - 1;
+	return mask;
+}
+
+/* Returns a mask of the bits of element ELEM_IDX that are part of
+   B at all. */
+static inline elem_type
+elem_mask (const struct bitmap *b, size_t elem_idx) {
+	return elem_idx == elem_cnt (b->bit_cnt) - 1 ? last_mask (b) : (elem_type) -1;
+}
+
+/* Brings the summary bit for element ELEM_IDX of B up to date.
+   Interrupts must be off. */
+static inline void
+update_summary (struct bitmap *b, size_t elem_idx) {
+	elem_type mask = elem_mask (b, elem_idx);
+
+	if ((b->bits[elem_idx] & mask) == mask)
+		b->summary[elem_idx / ELEM_BITS] |= bit_mask (elem_idx);
+	else
+		b->summary[elem_idx / ELEM_BITS] &= ~bit_mask (elem_idx);
+}
+
+/* Sets the bits of MASK in element ELEM_IDX of B to VALUE, or
+   toggles them if FLIP is true, atomically. */
+static void
+apply_mask (struct bitmap *b, size_t elem_idx, elem_type mask, bool value,
+		bool flip) {
+	elem_type *elem = &b->bits[elem_idx];
+	enum intr_level old_level = INTR_OFF;
+
+	if (b->summary != NULL)
+		old_level = intr_disable ();
+
+	/* These are equivalent to `*elem |= mask', `*elem &= ~mask' and
+	   `*elem ^= mask' except that they are guaranteed to be atomic
+	   on a uniprocessor machine.  See the descriptions of the OR,
+	   AND and XOR instructions in [IA32-v2a] and [IA32-v2b]. */
+	if (flip)
+		asm ("lock xorq %1, %0" : "+m" (*elem) : "r" (mask) : "cc");
+	else if (value)
+		asm ("lock orq %1, %0" : "+m" (*elem) : "r" (mask) : "cc");
+	else
+		asm ("lock andq %1, %0" : "+m" (*elem) : "r" (~mask) : "cc");
+
+	if (b->summary != NULL) {
+		update_summary (b, elem_idx);
+		intr_set_level (old_level);
+	}
+}
+
+/* Returns the index of the first element at or after ELEM_IDX, and
+   before END_ELEM, that the summary of B does not mark full, or
+   END_ELEM if there is none. */
+static size_t
+next_nonfull_elem (const struct bitmap *b, size_t elem_idx, size_t end_elem) {
+	while (elem_idx < end_elem) {
+		size_t sum_idx = elem_idx / ELEM_BITS;
+		elem_type free = ~b->summary[sum_idx]
+			& range_mask (sum_idx, elem_idx, end_elem);
+		if (free != 0)
+			return sum_idx * ELEM_BITS + __builtin_ctzl (free);
+		elem_idx = (sum_idx + 1) * ELEM_BITS;
+	}
+	return end_elem;
+}
+
+/* Returns the index of the first bit in B in [START, END) that is
+   set to VALUE, or END if there is none. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value) {
+	size_t i = elem_idx (start);
+	size_t end_elem = elem_cnt (end);
+
+	while (i < end_elem) {
+		elem_type elem = value ? b->bits[i] : ~b->bits[i];
+		elem &= range_mask (i, start, end);
+		if (elem != 0)
+			return i * ELEM_BITS + __builtin_ctzl (elem);
+		i++;
+		if (!value && b->summary != NULL)
+			i = next_nonfull_elem (b, i, end_elem);
+	}
+	return end;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -74,6 +192,7 @@ bitmap_create (size_t bit_cnt) {
 	struct bitmap *b = malloc (sizeof *b);
 	if (b != NULL) {
 		b->bit_cnt = bit_cnt;
+		b->summary = NULL;
 		b->bits = malloc (byte_cnt (bit_cnt));
 		if (b->bits != NULL || bit_cnt == 0) {
 			bitmap_set_all (b, false);
@@ -95,6 +214,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED) {
 
 	b->bit_cnt = bit_cnt;
 	b->bits = (elem_type *) (b + 1);
+	b->summary = NULL;
 	bitmap_set_all (b, false);
 	return b;
 }
@@ -106,9 +226,46 @@ bitmap_buf_size (size_t bit_cnt) {
 	return sizeof (struct bitmap) + byte_cnt (bit_cnt);
 }
 
+/* Returns the number of bytes required for the summary of a
+   bitmap with BIT_CNT bits (for use with bitmap_add_summary()). */
+size_t
+bitmap_summary_size (size_t bit_cnt) {
+	return byte_cnt (elem_cnt (bit_cnt));
+}
+
+/* Gives B a summary of its full elements, stored in the BLOCK_SIZE
+   bytes at BLOCK, which must be at least bitmap_summary_size() bytes
+   and must outlive B.  Searches for false bits in B then skip full
+   regions without reading them. */
+void
+bitmap_add_summary (struct bitmap *b, void *block, size_t block_size UNUSED) {
+	ASSERT (b != NULL);
+	ASSERT (block_size >= bitmap_summary_size (b->bit_cnt));
+
+	b->summary = block;
+	bitmap_rebuild_summary (b);
+}
+
+/* Recomputes B's summary, if it has one, from its bits. */
+void
+bitmap_rebuild_summary (struct bitmap *b) {
+	enum intr_level old_level;
+	size_t i;
+
+	if (b->summary == NULL)
+		return;
+	old_level = intr_disable ();
+	for (i = 0; i < elem_cnt (elem_cnt (b->bit_cnt)); i++)
+		b->summary[i] = 0;
+	for (i = 0; i < elem_cnt (b->bit_cnt); i++)
+		update_summary (b, i);
+	intr_set_level (old_level);
+}
+
 /* Destroys bitmap B, freeing its storage.
    Not for use on bitmaps created by
-   bitmap_create_preallocated(). */
+   bitmap_create_preallocated().  A summary added with
+   bitmap_add_summary() belongs to the caller. */
 void
 bitmap_destroy (struct bitmap *b) {
 	if (b != NULL) {
@@ -141,25 +298,13 @@ bitmap_set (struct bitmap *b, size_t idx, bool value) {
 /* Atomically sets the bit numbered BIT_IDX in B to true. */
 void
 bitmap_mark (struct bitmap *b, size_t bit_idx) {
-	size_t idx = elem_idx (bit_idx);
-	elem_type mask = bit_mask (bit_idx);
-
-	/* This is equivalent to `b->bits[idx] |= mask' except that it
-	   is guaranteed to be atomic on a uniprocessor machine.  See
-	   the description of the OR instruction in [IA32-v2b]. */
-	asm ("lock orq %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+	apply_mask (b, elem_idx (bit_idx), bit_mask (bit_idx), true, false);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
 void
 bitmap_reset (struct bitmap *b, size_t bit_idx) {
-	size_t idx = elem_idx (bit_idx);
-	elem_type mask = bit_mask (bit_idx);
-
-	/* This is equivalent to `b->bits[idx] &= ~mask' except that it
-	   is guaranteed to be atomic on a uniprocessor machine.  See
-	   the description of the AND instruction in [IA32-v2a]. */
-	asm ("lock andq %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+	apply_mask (b, elem_idx (bit_idx), bit_mask (bit_idx), false, false);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -167,13 +312,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx) {
    and if it is false, makes it true. */
 void
 bitmap_flip (struct bitmap *b, size_t bit_idx) {
-	size_t idx = elem_idx (bit_idx);
-	elem_type mask = bit_mask (bit_idx);
-
-	/* This is equivalent to `b->bits[idx] ^= mask' except that it
-	   is guaranteed to be atomic on a uniprocessor machine.  See
-	   the description of the XOR instruction in [IA32-v2b]. */
-	asm ("lock xorq %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+	apply_mask (b, elem_idx (bit_idx), bit_mask (bit_idx), false, true);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -194,50 +333,48 @@ bitmap_set_all (struct bitmap *b, bool value) {
 	bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, but not the range as a
+   whole. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) {
+	size_t end = start + cnt;
 	size_t i;
 
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		bitmap_set (b, start + i, value);
+	for (i = elem_idx (start); i < elem_cnt (end); i++)
+		apply_mask (b, i, range_mask (i, start, end), value, false);
 }
 
 /* Returns the number of bits in B between START and START + CNT,
    exclusive, that are set to VALUE. */
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i, value_cnt;
+	size_t end = start + cnt;
+	size_t i, true_cnt;
 
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	value_cnt = 0;
-	for (i = 0; i < cnt; i++)
-		if (bitmap_test (b, start + i) == value)
-			value_cnt++;
-	return value_cnt;
+	true_cnt = 0;
+	for (i = elem_idx (start); i < elem_cnt (end); i++)
+		true_cnt += elem_popcount (b->bits[i] & range_mask (i, start, end));
+	return value ? true_cnt : cnt - true_cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i;
-
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		if (bitmap_test (b, start + i) == value)
-			return true;
-	return false;
+	return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -266,7 +403,11 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt) {
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+
+   Jumps from one run of VALUE bits to the next instead of testing
+   every starting position, so the cost is about one pass over the
+   elements in the searched range. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) {
 	ASSERT (b != NULL);
@@ -274,10 +415,21 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) {
 
 	if (cnt <= b->bit_cnt) {
 		size_t last = b->bit_cnt - cnt;
-		size_t i;
-		for (i = start; i <= last; i++)
-			if (!bitmap_contains (b, i, cnt, !value))
+		size_t i = start;
+
+		if (cnt == 0)
+			return start;
+		while (i <= last) {
+			size_t end;
+
+			i = find_next (b, i, last + 1, value);
+			if (i > last)
+				break;
+			end = find_next (b, i, i + cnt, !value);
+			if (end == i + cnt)
 				return i;
+			i = end;
+		}
 	}
 	return BITMAP_ERROR;
 }
@@ -315,6 +467,7 @@ bitmap_read (struct bitmap *b, struct file *file) {
 		off_t size = byte_cnt (b->bit_cnt);
 		success = file_read_at (file, b->bits, size, 0) == size;
 		b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+		bitmap_rebuild_summary (b);
 	}
 	return success;
 }
@@ -0,0 +1,153 @@
+/* Test program and microbenchmark for lib/kernel/bitmap.c.
+
+   Checks the word-at-a-time bitmap_scan(), bitmap_count() and
+   bitmap_contains() against straightforward bit-by-bit versions
+   built on bitmap_test(), which is how they used to work, and
+   times both on multi-megabit bitmaps, with and without a summary
+   of full elements.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/test.h"
+
+/* Number of bits in the benchmark bitmaps: 4 Mbit. */
+#define BIT_CNT (4u << 20)
+
+/* Number of times each timed operation is repeated. */
+#define REPEAT 4
+
+static size_t slow_scan (const struct bitmap *, size_t start, size_t cnt,
+                         bool value);
+static size_t slow_count (const struct bitmap *, size_t start, size_t cnt,
+                          bool value);
+static void fill_random (struct bitmap *, unsigned percent);
+static void bench (const char *name, struct bitmap *, size_t cnt);
+
+/* Test and time the bitmap search implementations. */
+void
+test (void)
+{
+  struct bitmap *b = bitmap_create (BIT_CNT);
+  size_t summary_size = bitmap_summary_size (BIT_CNT);
+  void *summary = malloc (summary_size);
+
+  ASSERT (b != NULL && summary != NULL);
+
+  /* A pool that is almost full, with the only free run near the
+     end.  This is the palloc worst case the summary is for. */
+  bitmap_set_all (b, true);
+  bitmap_set_multiple (b, BIT_CNT - 100, 64, false);
+  bench ("nearly full, plain", b, 64);
+  bitmap_add_summary (b, summary, summary_size);
+  bench ("nearly full, summary", b, 64);
+
+  /* A fragmented bitmap: random bits, and a run that is long
+     enough only once in a while. */
+  fill_random (b, 75);
+  bench ("75% random, summary", b, 4);
+  bitmap_destroy (b);
+
+  b = bitmap_create (BIT_CNT);
+  ASSERT (b != NULL);
+  fill_random (b, 75);
+  bench ("75% random, plain", b, 4);
+  bitmap_destroy (b);
+  free (summary);
+
+  printf ("done\n");
+}
+
+/* Times bitmap_scan() for CNT false bits and bitmap_count() over the
+   whole of B against the bit-by-bit versions, checking that they
+   agree. */
+static void
+bench (const char *name, struct bitmap *b, size_t cnt)
+{
+  size_t fast_idx = 0, slow_idx = 0, fast_cnt = 0, slow_cnt = 0;
+  int64_t start;
+  int64_t fast_scan_ticks, slow_scan_ticks, fast_count_ticks, slow_count_ticks;
+  int i;
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT; i++)
+    fast_idx = bitmap_scan (b, 0, cnt, false);
+  fast_scan_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT; i++)
+    slow_idx = slow_scan (b, 0, cnt, false);
+  slow_scan_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT; i++)
+    fast_cnt = bitmap_count (b, 0, BIT_CNT, false);
+  fast_count_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < REPEAT; i++)
+    slow_cnt = slow_count (b, 0, BIT_CNT, false);
+  slow_count_ticks = timer_elapsed (start);
+
+  ASSERT (fast_idx == slow_idx);
+  ASSERT (fast_cnt == slow_cnt);
+  ASSERT (bitmap_contains (b, 0, BIT_CNT, false) == (slow_cnt > 0));
+
+  printf ("%s: scan %"PRId64" vs %"PRId64" ticks, "
+          "count %"PRId64" vs %"PRId64" ticks (new vs old)\n",
+          name, fast_scan_ticks, slow_scan_ticks,
+          fast_count_ticks, slow_count_ticks);
+}
+
+/* Sets each bit of B to true with a probability of PERCENT. */
+static void
+fill_random (struct bitmap *b, unsigned percent)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, random_ulong () % 100 < percent);
+}
+
+/* bitmap_scan() as it was before it worked on whole elements:
+   try every starting position, testing one bit at a time. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  if (cnt <= bitmap_size (b))
+    {
+      size_t last = bitmap_size (b) - cnt;
+      size_t i, j;
+
+      for (i = start; i <= last; i++)
+        {
+          for (j = 0; j < cnt; j++)
+            if (bitmap_test (b, i + j) != value)
+              break;
+          if (j == cnt)
+            return i;
+        }
+    }
+  return BITMAP_ERROR;
+}
+
+/* bitmap_count() as it was before it worked on whole elements. */
+static size_t
+slow_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      value_cnt++;
+  return value_cnt;
+}
@@ -142,7 +142,12 @@ bss_init (void) {
 
 /* Populates the page table with the kernel virtual mapping,
  * and then sets up the CPU to use the new page directory.
- * Points base_pml4 to the pml4 it creates. */
+ * Points base_pml4 to the pml4 it creates.
+ *
+ * Every 2 MB-aligned chunk of physical memory is mapped with a
+ * single large page, which saves both TLB entries and page-table
+ * pages.  Only the chunks that contain read-only kernel text, or
+ * that are cut short by MEM_END, fall back to 4 kB pages. */
 static void
 paging_init (uint64_t mem_end) {
 	uint64_t *pml4, *pte;
@@ -152,19 +157,30 @@ paging_init (uint64_t mem_end) {
 	extern char start, _end_kernel_text;
 	// Maps physical address [0 ~ mem_end] to
 	//   [LOADER_KERN_BASE ~ LOADER_KERN_BASE + mem_end].
-	for (uint64_t pa = 0; pa < mem_end; pa += PGSIZE) {
+	for (uint64_t pa = 0; pa < mem_end; ) {
 		uint64_t va = (uint64_t) ptov(pa);
 
+		if (pa % LARGE_PGSIZE == 0 && pa + LARGE_PGSIZE <= mem_end
+				&& (va + LARGE_PGSIZE <= (uint64_t) &start
+					|| va >= (uint64_t) &_end_kernel_text)) {
+			if ((pte = pml4e_walk_pde (pml4, va, 1)) != NULL)
+				*pte = pa | PTE_P | PTE_W | PTE_PS;
+			pa += LARGE_PGSIZE;
+			continue;
+		}
+
 		perm = PTE_P | PTE_W;
 		if ((uint64_t) &start <= va && va < (uint64_t) &_end_kernel_text)
 			perm &= ~PTE_W;
 
 		if ((pte = pml4e_walk (pml4, va, 1)) != NULL)
 			*pte = pa | perm;
+		pa += PGSIZE;
 	}
 
 	// reload cr3
 	pml4_activate(0);
+	pcid_init ();
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -226,6 +242,32 @@ parse_options (char **argv) {
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-vm-policy")) {
+			if (value != NULL && !strcmp (value, "clock"))
+				vm_policy = VM_POLICY_CLOCK;
+			else if (value != NULL && !strcmp (value, "2q"))
+				vm_policy = VM_POLICY_2Q;
+			else
+				PANIC ("unknown replacement policy `%s' (use -h for help)",
+						value != NULL ? value : "");
+		}
+		else if (!strcmp (name, "-ksm"))
+			vm_ksm = true;
+		else if (!strcmp (name, "-populate"))
+			vm_populate_all = true;
+		else if (!strcmp (name, "-thp"))
+			vm_thp = true;
+		else if (!strcmp (name, "-rss-limit")) {
+			if (value != NULL && !strcmp (value, "auto"))
+				vm_rss_auto = true;
+			else if (value != NULL && atoi (value) > 0)
+				vm_rss_limit = atoi (value);
+			else
+				PANIC ("bad resident set limit `%s' (use -h for help)",
+						value != NULL ? value : "");
+		}
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -328,6 +370,15 @@ usage (void) {
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -vm-policy=POLICY  Evict frames by POLICY: clock (default) or 2q.\n"
+			"  -ksm               Merge identical anonymous pages in the background.\n"
+			"  -populate          Load programs in full, stack included, at exec.\n"
+			"  -thp               Map large anonymous regions with 2 MB pages.\n"
+			"  -rss-limit=N       Keep each process to N pages in memory.\n"
+			"  -rss-limit=auto    Trim processes to their working sets when memory\n"
+			"                     is short.\n"
 #endif
 			);
 	power_off ();
@@ -354,6 +405,7 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -362,4 +414,7 @@ print_stats (void) {
 #ifdef USERPROG
 	exception_print_stats ();
 #endif
+#ifdef VM
+	vm_print_stats ();
+#endif
 }
@@ -1,18 +1,26 @@
+#include <bitmap.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "intrinsic.h"
 
+/* If STOP_AT_PDE is true, returns the page-directory entry for VA instead of
+ * descending into (and possibly creating) its page table.  A present
+ * 2 MB entry is always returned as is, since there is no page table
+ * under it. */
 static uint64_t *
-pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
+pgdir_walk (uint64_t *pdp, const uint64_t va, int create, bool stop_at_pde) {
 	int idx = PDX (va);
 	if (pdp) {
 		uint64_t *pte = (uint64_t *) pdp[idx];
+		if (stop_at_pde || ((uint64_t) pte & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+			return &pdp[idx];
 		if (!((uint64_t) pte & PTE_P)) {
 			if (create) {
 				uint64_t *new_page = palloc_get_page (PAL_ZERO);
@@ -29,7 +37,7 @@ pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 }
 
 static uint64_t *
-pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
+pdpe_walk (uint64_t *pdpe, const uint64_t va, int create, bool stop_at_pde) {
 	uint64_t *pte = NULL;
 	int idx = PDPE (va);
 	int allocated = 0;
@@ -46,7 +54,7 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
 			} else
 				return NULL;
 		}
-		pte = pgdir_walk (ptov (PTE_ADDR (pdpe[idx])), va, create);
+		pte = pgdir_walk (ptov (PTE_ADDR (pdpe[idx])), va, create, stop_at_pde);
 	}
 	if (pte == NULL && allocated) {
 		palloc_free_page ((void *) ptov (PTE_ADDR (pdpe[idx])));
@@ -55,14 +63,8 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
 	return pte;
 }
 
-/* Returns the address of the page table entry for virtual
- * address VADDR in page map level 4, pml4.
- * If PML4E does not have a page table for VADDR, behavior depends
- * on CREATE.  If CREATE is true, then a new page table is
- * created and a pointer into it is returned.  Otherwise, a null
- * pointer is returned. */
-uint64_t *
-pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
+static uint64_t *
+pml4_walk (uint64_t *pml4e, const uint64_t va, int create, bool stop_at_pde) {
 	uint64_t *pte = NULL;
 	int idx = PML4 (va);
 	int allocated = 0;
@@ -79,7 +81,7 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 			} else
 				return NULL;
 		}
-		pte = pdpe_walk (ptov (PTE_ADDR (pml4e[idx])), va, create);
+		pte = pdpe_walk (ptov (PTE_ADDR (pml4e[idx])), va, create, stop_at_pde);
 	}
 	if (pte == NULL && allocated) {
 		palloc_free_page ((void *) ptov (PTE_ADDR (pml4e[idx])));
@@ -88,6 +90,114 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	return pte;
 }
 
+/* Returns the address of the page table entry for virtual
+ * address VADDR in page map level 4, pml4.
+ * If PML4E does not have a page table for VADDR, behavior depends
+ * on CREATE.  If CREATE is true, then a new page table is
+ * created and a pointer into it is returned.  Otherwise, a null
+ * pointer is returned.
+ * If VADDR is covered by a 2 MB mapping, the page-directory entry
+ * (with PTE_PS set) is returned instead. */
+uint64_t *
+pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
+	return pml4_walk (pml4e, va, create, false);
+}
+
+/* Returns the address of the page-directory entry for virtual
+ * address VADDR in PML4E, for installing or inspecting a 2 MB
+ * mapping.  Intermediate tables are created if CREATE is true;
+ * otherwise a null pointer is returned if they are missing. */
+uint64_t *
+pml4e_walk_pde (uint64_t *pml4e, const uint64_t va, int create) {
+	return pml4_walk (pml4e, va, create, true);
+}
+
+/* Process-context identifiers (PCIDs).
+ *
+ * When the CPU supports it, every pml4 gets its own 12-bit PCID and
+ * CR3 is loaded with the no-flush bit, so the TLB entries of an
+ * address space survive while other address spaces run.  PCID 0
+ * belongs to base_pml4 and to any pml4 created after the PCIDs ran
+ * out; it is always loaded with a full flush, because several
+ * address spaces may share it.
+ *
+ * A pml4's PCID lives in the address bits of its last entry, which
+ * Pintos never maps: the entry's present bit stays clear, so the
+ * CPU ignores it.
+ *
+ * invlpg only reaches the active PCID.  A change to the page table
+ * of an inactive address space therefore marks its PCID stale,
+ * and the next activation reloads CR3 with a flush instead. */
+#define PCID_CNT 4096                   /* Number of PCIDs. */
+#define PCID_SLOT (PGSIZE / sizeof (uint64_t) - 1)
+#define CR3_NOFLUSH (1ULL << 63)        /* Keep the PCID's TLB entries. */
+#define CR4_PCIDE (1 << 17)             /* Enable PCIDs. */
+#define CPUID_ECX_PCID (1 << 17)        /* CPUID.01H:ECX, PCID support. */
+
+/* PCID_USED is protected by disabling interrupts rather than by a
+ * lock, since pml4_activate reads the PCIDs from within schedule. */
+static bool pcid_enabled;               /* CR4.PCIDE is set. */
+static struct bitmap *pcid_used;        /* PCIDs assigned to a pml4. */
+static struct bitmap *pcid_stale;       /* PCIDs that need a flush. */
+
+/* Turns on PCIDs if the CPU supports them.  Must be called with
+ * base_pml4 active, since CR3 may not carry a PCID while CR4.PCIDE
+ * is being set. */
+void
+pcid_init (void) {
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid (1, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_ECX_PCID))
+		return;
+
+	pcid_used = bitmap_create (PCID_CNT);
+	pcid_stale = bitmap_create (PCID_CNT);
+	if (pcid_used == NULL || pcid_stale == NULL) {
+		bitmap_destroy (pcid_used);
+		bitmap_destroy (pcid_stale);
+		return;
+	}
+	bitmap_mark (pcid_used, 0);
+
+	ASSERT (rcr3 () == vtop (base_pml4));
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+/* Returns the PCID of PML4. */
+static unsigned
+pml4_pcid (uint64_t *pml4) {
+	return pml4[PCID_SLOT] >> PGBITS;
+}
+
+/* Returns true if PML4 is the active address space. */
+static bool
+pml4_is_active (uint64_t *pml4) {
+	return PTE_ADDR (rcr3 ()) == vtop (pml4);
+}
+
+/* Drops any TLB entry for VA in PML4.  VA is flushed right away
+ * when PML4 is active; otherwise PML4's PCID is flushed as a whole
+ * the next time it is activated. */
+static void
+pml4_invalidate (uint64_t *pml4, uint64_t va) {
+	if (pml4_is_active (pml4))
+		invlpg (va);
+	else if (pcid_enabled && pml4_pcid (pml4) != 0)
+		bitmap_mark (pcid_stale, pml4_pcid (pml4));
+}
+
+/* Drops every TLB entry of PML4.  Reloads CR3 if PML4 is active;
+ * otherwise its PCID is flushed on its next activation. */
+static void
+pml4_flush (uint64_t *pml4) {
+	if (pcid_enabled && pml4_pcid (pml4) != 0)
+		bitmap_mark (pcid_stale, pml4_pcid (pml4));
+	if (pml4_is_active (pml4))
+		pml4_activate (pml4);
+}
+
 /* Creates a new page map level 4 (pml4) has mappings for kernel
  * virtual addresses, but none for user virtual addresses.
  * Returns the new page directory, or a null pointer if memory
@@ -95,8 +205,20 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 uint64_t *
 pml4_create (void) {
 	uint64_t *pml4 = palloc_get_page (0);
-	if (pml4)
+	if (pml4) {
 		memcpy (pml4, base_pml4, PGSIZE);
+		pml4[PCID_SLOT] = 0;
+		if (pcid_enabled) {
+			enum intr_level old_level = intr_disable ();
+			size_t pcid = bitmap_scan_and_flip (pcid_used, 1, 1, false);
+			intr_set_level (old_level);
+			if (pcid != BITMAP_ERROR) {
+				/* A previous owner may have left entries behind. */
+				bitmap_mark (pcid_stale, pcid);
+				pml4[PCID_SLOT] = (uint64_t) pcid << PGBITS;
+			}
+		}
+	}
 	return pml4;
 }
 
@@ -122,10 +244,18 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
+		if (((uint64_t) pte) & PTE_P) {
+			if (((uint64_t) pte) & PTE_PS) {
+				/* 2 MB mapping: hand the PDE itself to FUNC. */
+				void *va = (void *) (((uint64_t) pml4_index << PML4SHIFT) |
+									 ((uint64_t) pdp_index << PDPESHIFT) |
+									 ((uint64_t) i << PDXSHIFT));
+				if (!func (&pdp[i], va, aux))
+					return false;
+			} else if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
+		}
 	}
 	return true;
 }
@@ -143,7 +273,9 @@ pdp_for_each (uint64_t *pdp,
 	return true;
 }
 
-/* Apply FUNC to each available pte entries including kernel's. */
+/* Apply FUNC to each available pte entries including kernel's.
+ * For a 2 MB mapping FUNC receives the page-directory entry, which
+ * has PTE_PS set, and the 2 MB-aligned VA it maps. */
 bool
 pml4_for_each (uint64_t *pml4, pte_for_each_func *func, void *aux) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
@@ -169,8 +301,13 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			pt_destroy (PTE_ADDR (pte));
+		if (((uint64_t) pte) & PTE_P) {
+			if (((uint64_t) pte) & PTE_PS)
+				palloc_free_multiple ((void *) PTE_ADDR (pte),
+						LARGE_PGSIZE / PGSIZE);
+			else
+				pt_destroy (PTE_ADDR (pte));
+		}
 	}
 	palloc_free_page ((void *) pdp);
 }
@@ -196,14 +333,33 @@ pml4_destroy (uint64_t *pml4) {
 	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
 	if (((uint64_t) pdpe) & PTE_P)
 		pdpe_destroy ((void *) PTE_ADDR (pdpe));
+	if (pcid_enabled && pml4_pcid (pml4) != 0) {
+		enum intr_level old_level = intr_disable ();
+		bitmap_reset (pcid_used, pml4_pcid (pml4));
+		intr_set_level (old_level);
+	}
 	palloc_free_page ((void *) pml4);
 }
 
 /* Loads page directory PD into the CPU's page directory base
- * register. */
+ * register.  With PCIDs enabled, the TLB entries tagged with PD's
+ * PCID are kept unless they went stale while PD was inactive. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	uint64_t cr3;
+
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+	cr3 = vtop (pml4);
+	if (pcid_enabled) {
+		unsigned pcid = pml4_pcid (pml4);
+		cr3 |= pcid;
+		if (pcid != 0 && !bitmap_test (pcid_stale, pcid))
+			cr3 |= CR3_NOFLUSH;
+		else if (pcid != 0)
+			bitmap_reset (pcid_stale, pcid);
+	}
+	lcr3 (cr3);
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -216,8 +372,11 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
-	if (pte && (*pte & PTE_P))
+	if (pte && (*pte & PTE_P)) {
+		if (*pte & PTE_PS)
+			return ptov (PTE_ADDR (*pte)) + ((uint64_t) uaddr & LARGE_PGMASK);
 		return ptov (PTE_ADDR (*pte)) + pg_ofs (uaddr);
+	}
 	return NULL;
 }
 
@@ -238,11 +397,95 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
 
-	if (pte)
+	/* A 4 kB page cannot be installed inside a 2 MB mapping. */
+	if (pte && (*pte & PTE_PS))
+		return false;
+	if (pte) {
+		bool was_present = (*pte & PTE_P) != 0;
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+		if (was_present)
+			pml4_invalidate (pml4, (uint64_t) upage);
+	}
 	return pte != NULL;
 }
 
+/* Maps the 2 MB of user virtual memory at UPAGE in PML4 to the 2 MB
+ * of physical memory at kernel virtual address KPAGE, with a single
+ * page-directory entry.  Both must be 2 MB-aligned.  A page table
+ * already under that entry is freed, which it may only be if none of
+ * its entries is present.  Returns false if one is, if UPAGE is mapped
+ * with a 2 MB page already, or if memory allocation failed. */
+bool
+pml4_set_large_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	uint64_t *pde;
+
+	ASSERT (((uint64_t) upage & LARGE_PGMASK) == 0);
+	ASSERT ((vtop (kpage) & LARGE_PGMASK) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	pde = pml4e_walk_pde (pml4, (uint64_t) upage, 1);
+	if (pde == NULL)
+		return false;
+	if (*pde & PTE_P) {
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+
+		if (*pde & PTE_PS)
+			return false;
+		for (unsigned i = 0; i < PGSIZE / sizeof *pt; i++)
+			if (pt[i] & PTE_P)
+				return false;
+		palloc_free_page (pt);
+	}
+	*pde = vtop (kpage) | PTE_PS | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	pml4_invalidate (pml4, (uint64_t) upage);
+	return true;
+}
+
+/* Replaces the 2 MB mapping that covers user virtual address UPAGE
+ * in PML4, if there is one, with a page table that maps the same
+ * memory in 4 kB pages.  Each PTE gets the 2 MB page's permissions
+ * and its accessed and dirty bits.  Returns false, leaving the 2 MB
+ * mapping in place, if memory allocation failed. */
+bool
+pml4_split_large_page (uint64_t *pml4, void *upage) {
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) upage, 0);
+	uint64_t *pt, pa, flags;
+
+	ASSERT (is_user_vaddr (upage));
+
+	if (pde == NULL || (*pde & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS))
+		return true;
+	pt = palloc_get_page (0);
+	if (pt == NULL)
+		return false;
+	pa = PTE_ADDR (*pde);
+	flags = *pde & (PTE_P | PTE_W | PTE_U | PTE_A | PTE_D);
+	for (unsigned i = 0; i < PGSIZE / sizeof *pt; i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	pml4_invalidate (pml4, (uint64_t) upage & ~LARGE_PGMASK);
+	return true;
+}
+
+/* Points the existing mapping of user virtual page UPAGE in PML4
+ * at the physical frame identified by kernel virtual address KPAGE,
+ * keeping its permissions and its accessed and dirty bits.  Used to
+ * migrate a frame: the caller copies the contents across first.
+ * UPAGE must be mapped with a 4 kB page. */
+void
+pml4_move_page (uint64_t *pml4, void *upage, void *kpage) {
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (pg_ofs (kpage) == 0);
+	ASSERT (is_user_vaddr (upage));
+
+	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 0);
+
+	ASSERT (pte != NULL && (*pte & PTE_P) && !(*pte & PTE_PS));
+	*pte = vtop (kpage) | (*pte & PTE_FLAGS);
+	pml4_invalidate (pml4, (uint64_t) upage);
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
@@ -257,9 +500,93 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		pml4_invalidate (pml4, (uint64_t) upage);
+	}
+}
+
+/* Beyond this many pages, one CR3 reload is cheaper than one
+ * invlpg per page. */
+#define INVLPG_MAX 32
+
+/* Marks the PAGE_CNT user virtual pages starting at UPAGE "not
+ * present" in PML4, like pml4_clear_page() does for one page, and
+ * returns the number of pages that were present.
+ *
+ * Page tables are walked once per 2 MB rather than once per page.
+ * For each present page FUNC, if non-null, is called with the page's
+ * address, the PTE as it was before clearing (so that PTE_D and
+ * PTE_A can be examined) and AUX.  A 2 MB mapping that the range
+ * covers entirely is cleared as a whole, and FUNC sees its PDE.  One
+ * that the range covers only in part is split into 4 kB pages first,
+ * or, if there is no memory for the page table, cleared as a whole
+ * all the same.
+ *
+ * The TLB is invalidated after the whole range is cleared: per page
+ * with invlpg for small ranges, or with a single CR3 reload beyond
+ * INVLPG_MAX pages. */
+size_t
+pml4_clear_range (uint64_t *pml4, void *upage, size_t page_cnt,
+		pte_clear_func *func, void *aux) {
+	uint64_t va = (uint64_t) upage;
+	uint64_t end = va + page_cnt * PGSIZE;
+	uint64_t flush[INVLPG_MAX];
+	size_t cleared = 0;
+
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (end >= va && (end == va || is_user_vaddr (end - 1)));
+
+	while (va < end) {
+		uint64_t next = (va + LARGE_PGSIZE) & ~LARGE_PGMASK;
+		uint64_t *pte = pml4e_walk (pml4, va, false);
+
+		if (next > end)
+			next = end;
+		if (pte == NULL) {
+			/* No page table here: skip to the next one. */
+			va = next;
+			continue;
+		}
+		if (*pte & PTE_PS) {
+			uint64_t base = va & ~LARGE_PGMASK;
+
+			/* Walk again, into the new page table. */
+			if ((*pte & PTE_P) && (va != base || base + LARGE_PGSIZE > end)
+					&& pml4_split_large_page (pml4, (void *) va))
+				continue;
+			if (*pte & PTE_P) {
+				if (func)
+					func ((void *) base, *pte, aux);
+				/* Always more than INVLPG_MAX, so no need to record. */
+				cleared += LARGE_PGSIZE / PGSIZE;
+			}
+			/* Left with PTE_PS set, the entry would be taken for a
+			 * page table when the range is mapped again. */
+			*pte = 0;
+			va = next;
+			continue;
+		}
+
+		/* The rest of this 2 MB sits in the same page table. */
+		for (; va < next; va += PGSIZE, pte++) {
+			if (!(*pte & PTE_P))
+				continue;
+			if (func)
+				func ((void *) va, *pte, aux);
+			*pte &= ~PTE_P;
+			if (++cleared <= INVLPG_MAX)
+				flush[cleared - 1] = va;
+		}
 	}
+
+	if (cleared > INVLPG_MAX)
+		pml4_flush (pml4);
+	else if (cleared > 0 && pml4_is_active (pml4)) {
+		for (size_t i = 0; i < cleared; i++)
+			invlpg (flush[i]);
+	} else if (cleared > 0)
+		pml4_invalidate (pml4, (uint64_t) upage);
+	return cleared;
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
@@ -283,8 +610,7 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
 		else
 			*pte &= ~(uint32_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_invalidate (pml4, (uint64_t) vpage);
 	}
 }
 
@@ -309,7 +635,6 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 		else
 			*pte &= ~(uint32_t) PTE_A;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_invalidate (pml4, (uint64_t) vpage);
 	}
 }
@@ -8,9 +8,14 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
+#include "threads/pte.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 /* Page allocator.  Hands out memory in page-size (or
    page-multiple) chunks.  See malloc.h for an allocator that
@@ -24,13 +29,53 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Each pool also keeps a small stack of pages that the idle
+   thread zeroed ahead of time (see palloc_prezero_page()).  These
+   pages are marked used in the pool's bitmap, so a PAL_ZERO
+   request for a single page can be satisfied without paying for
+   the memset on the caller's critical path.  The stack is
+   protected by disabling interrupts rather than by the pool lock,
+   because the idle thread must never block.
+
+   The split between the pools is not final, either.  When a pool
+   runs out, it borrows free pages from the other pool, as long as
+   the lender keeps at least its low watermark of pages free.  The
+   kernel pool's watermark is much higher, so that user processes
+   can never eat into the kernel's minimum reserve.  A borrowed page
+   is remembered in its home pool's lent_map and simply goes back
+   there when it is freed.
+
+   With virtual memory, a multi-page user request that still fails
+   because the user pool is fragmented asks the VM to compact it:
+   vm_compact() picks a range whose used pages are all movable user
+   frames, claims it with palloc_claim_user_range(), and migrates the
+   frames out of the way. */
+
+/* Number of pre-zeroed pages each pool keeps in reserve. */
+#define PREZERO_CNT 64
+
+/* Low watermarks, as a fraction of the pool's size: a pool lends
+   pages to the other pool only while more than SIZE / N of its own
+   pages stay free. */
+#define KERNEL_RESERVE_DIV 4
+#define USER_RESERVE_DIV 16
 
 /* A memory pool. */
 struct pool {
 	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
 	uint8_t *base;                  /* Base of pool. */
+	size_t free_cnt;                /* Number of false bits in USED_MAP. */
+
+	void *zeroed[PREZERO_CNT];      /* Pre-zeroed pages, used in USED_MAP. */
+	size_t zeroed_cnt;              /* Number of entries in ZEROED. */
+
+	struct bitmap *lent_map;        /* Pages lent to the other pool. */
+	size_t reserve;                 /* Low watermark for lending. */
+	size_t lent_out;                /* Number of pages lent right now. */
+	long long lent_total;           /* Number of pages ever lent. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -38,10 +83,20 @@ static struct pool kernel_pool, user_pool;
 
 /* Maximum number of pages to put in user pool. */
 size_t user_page_limit = SIZE_MAX;
+
+/* Statistics. */
+static long long prezero_hits;  /* # of PAL_ZERO pages served pre-zeroed. */
+static long long prezero_miss;  /* # of PAL_ZERO pages zeroed inline. */
+
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static size_t pool_scan_and_take (struct pool *, size_t page_cnt);
+static void pool_adjust_free (struct pool *, long delta);
+static void *borrow_pages (struct pool *, size_t page_cnt);
+static void *take_zeroed_page (struct pool *);
+static bool release_zeroed_pages (struct pool *);
 
 /* multiboot info */
 struct multiboot_info {
@@ -250,6 +305,16 @@ palloc_init (void) {
 	printf ("\text_mem: 0x%llx ~ 0x%llx (Usable: %'llu kB)\n",
 		  ext_mem.start, ext_mem.end, ext_mem.size / 1024);
 	populate_pools (&base_mem, &ext_mem);
+
+	kernel_pool.free_cnt = bitmap_count (kernel_pool.used_map, 0,
+			bitmap_size (kernel_pool.used_map), false);
+	kernel_pool.reserve = kernel_pool.free_cnt / KERNEL_RESERVE_DIV;
+	if (user_page_limit != SIZE_MAX)
+		/* -ul caps user memory, so the kernel must not lend. */
+		kernel_pool.reserve = SIZE_MAX / 2;
+	user_pool.free_cnt = bitmap_count (user_pool.used_map, 0,
+			bitmap_size (user_pool.used_map), false);
+	user_pool.reserve = user_pool.free_cnt / USER_RESERVE_DIV;
 	return ext_mem.end;
 }
 
@@ -262,20 +327,45 @@ palloc_init (void) {
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	struct pool *other = flags & PAL_USER ? &kernel_pool : &user_pool;
+	bool zeroed = false;
+	void *pages;
+
+	/* A single zeroed page comes from the pre-zeroed stack if the
+	   idle thread has left one there. */
+	if (page_cnt == 1 && (flags & PAL_ZERO)) {
+		pages = take_zeroed_page (pool);
+		if (pages != NULL) {
+			prezero_hits++;
+			return pages;
+		}
+	}
 
 	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	size_t page_idx = pool_scan_and_take (pool, page_cnt);
+	if (page_idx == BITMAP_ERROR && page_cnt > 1
+			&& release_zeroed_pages (pool))
+		page_idx = pool_scan_and_take (pool, page_cnt);
 	lock_release (&pool->lock);
-	void *pages;
 
 	if (page_idx != BITMAP_ERROR)
 		pages = pool->base + PGSIZE * page_idx;
+	else if (page_cnt == 1
+			&& (pages = take_zeroed_page (pool)) != NULL)
+		/* Out of free pages: the pre-zeroed ones are still usable. */
+		zeroed = true;
 	else
-		pages = NULL;
+		pages = borrow_pages (other, page_cnt);
+#ifdef VM
+	if (pages == NULL && (flags & PAL_USER) && page_cnt > 1)
+		pages = vm_compact (page_cnt);
+#endif
 
 	if (pages) {
-		if (flags & PAL_ZERO)
+		if ((flags & PAL_ZERO) && !zeroed) {
+			prezero_miss += page_cnt;
 			memset (pages, 0, PGSIZE * page_cnt);
+		}
 	} else {
 		if (flags & PAL_ASSERT)
 			PANIC ("palloc_get: out of pages");
@@ -296,6 +386,42 @@ palloc_get_page (enum palloc_flags flags) {
 	return palloc_get_multiple (flags, 1);
 }
 
+/* Obtains LARGE_PGSIZE / PGSIZE contiguous pages from the pool that
+   FLAGS selects, starting at a physical address that is a multiple of
+   LARGE_PGSIZE, so that they can be mapped with one 2 MB page.  Only
+   the pool's own free pages are considered: nothing is borrowed and
+   nothing is compacted for it.  Returns a null pointer if there is no
+   such range.  The pages may be freed one at a time. */
+void *
+palloc_get_large (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t page_cnt = LARGE_PGSIZE / PGSIZE;
+	size_t pool_size, page_idx;
+	void *pages = NULL;
+
+	if (pool->used_map == NULL)
+		return NULL;
+	pool_size = bitmap_size (pool->used_map);
+	page_idx = (LARGE_PGSIZE - vtop (pool->base) % LARGE_PGSIZE)
+		% LARGE_PGSIZE / PGSIZE;
+
+	lock_acquire (&pool->lock);
+	for (; page_idx + page_cnt <= pool_size; page_idx += page_cnt)
+		if (!bitmap_contains (pool->used_map, page_idx, page_cnt, true)) {
+			bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+			pool_adjust_free (pool, -(long) page_cnt);
+			pages = pool->base + PGSIZE * page_idx;
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (pages != NULL && (flags & PAL_ZERO))
+		memset (pages, 0, LARGE_PGSIZE);
+	if (pages == NULL && (flags & PAL_ASSERT))
+		PANIC ("palloc_get_large: out of pages");
+	return pages;
+}
+
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) {
@@ -319,7 +445,15 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+	if (bitmap_test (pool->lent_map, page_idx)) {
+		/* Coming home from the other pool. */
+		enum intr_level old_level = intr_disable ();
+		bitmap_set_multiple (pool->lent_map, page_idx, page_cnt, false);
+		pool->lent_out -= page_cnt;
+		intr_set_level (old_level);
+	}
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	pool_adjust_free (pool, page_cnt);
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +462,220 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Zeroes one free page ahead of time and stashes it on its pool's
+   pre-zeroed stack, preferring the user pool.  Returns true if a
+   page was zeroed, false if every stack is full or no free page
+   could be taken without blocking.
+
+   Called by the idle thread, so it must never sleep: the pool lock
+   is only ever try-acquired. */
+bool
+palloc_prezero_page (void) {
+	struct pool *pools[] = { &user_pool, &kernel_pool };
+	size_t i;
+
+	for (i = 0; i < sizeof pools / sizeof *pools; i++) {
+		struct pool *pool = pools[i];
+		enum intr_level old_level;
+		size_t page_idx;
+		void *page;
+
+		if (pool->used_map == NULL || pool->zeroed_cnt >= PREZERO_CNT)
+			continue;
+		if (!lock_try_acquire (&pool->lock))
+			continue;
+		page_idx = pool_scan_and_take (pool, 1);
+		lock_release (&pool->lock);
+		if (page_idx == BITMAP_ERROR)
+			continue;
+
+		page = pool->base + PGSIZE * page_idx;
+		memset (page, 0, PGSIZE);
+
+		/* Only the idle thread pushes, so there is still room. */
+		old_level = intr_disable ();
+		ASSERT (pool->zeroed_cnt < PREZERO_CNT);
+		pool->zeroed[pool->zeroed_cnt++] = page;
+		intr_set_level (old_level);
+		return true;
+	}
+	return false;
+}
+
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void) {
+	printf ("Palloc: %lld zeroed pages pre-zeroed, %lld zeroed inline\n",
+			prezero_hits, prezero_miss);
+	printf ("Palloc: %lld pages lent to user pool (%zu now), "
+			"%lld to kernel pool (%zu now)\n",
+			kernel_pool.lent_total, kernel_pool.lent_out,
+			user_pool.lent_total, user_pool.lent_out);
+}
+
+/* Returns the number of pages in the user pool. */
+size_t
+palloc_user_page_cnt (void) {
+	return bitmap_size (user_pool.used_map);
+}
+
+/* Returns the number of free pages in the user pool, counting those
+   on its pre-zeroed stack.  The answer may be stale by the time the
+   caller looks at it. */
+size_t
+palloc_user_free_cnt (void) {
+	enum intr_level old_level = intr_disable ();
+	size_t cnt = user_pool.free_cnt + user_pool.zeroed_cnt;
+	intr_set_level (old_level);
+	return cnt;
+}
+
+/* Returns the index of PAGE within the user pool, or SIZE_MAX if
+   PAGE is not a user pool page. */
+size_t
+palloc_user_page_idx (const void *page) {
+	if (!page_from_pool (&user_pool, (void *) page))
+		return SIZE_MAX;
+	return pg_no (page) - pg_no (user_pool.base);
+}
+
+/* Finds PAGE_CNT contiguous user pool pages each of which is either
+   free or set in MOVABLE, a bitmap indexed like the user pool, and
+   marks the free ones used.  Among all such ranges, picks the one
+   with the fewest movable pages.  Returns the first page of the
+   range, or a null pointer if there is none.
+
+   The caller owns the free pages of the range from now on, and must
+   move whatever occupies its movable pages elsewhere before using
+   them.  Used by vm_compact(). */
+void *
+palloc_claim_user_range (size_t page_cnt, const struct bitmap *movable) {
+	struct pool *pool = &user_pool;
+	size_t pool_size = bitmap_size (pool->used_map);
+	size_t best = BITMAP_ERROR, best_moves = SIZE_MAX;
+	size_t run = 0, moves = 0;
+	size_t i;
+
+	ASSERT (bitmap_size (movable) == pool_size);
+	ASSERT (page_cnt > 0);
+
+	lock_acquire (&pool->lock);
+	release_zeroed_pages (pool);
+
+	/* Slide a window over the pool, counting the movable pages in
+	   the current run of free-or-movable pages. */
+	for (i = 0; i < pool_size; i++) {
+		bool used = bitmap_test (pool->used_map, i);
+
+		if (used && !bitmap_test (movable, i)) {
+			run = moves = 0;
+			continue;
+		}
+		run++;
+		moves += used;
+		if (run > page_cnt) {
+			/* Drop the page that fell out of the window. */
+			run--;
+			moves -= bitmap_test (pool->used_map, i - page_cnt);
+		}
+		if (run == page_cnt && moves < best_moves) {
+			best = i + 1 - page_cnt;
+			best_moves = moves;
+			if (moves == 0)
+				break;
+		}
+	}
+
+	if (best != BITMAP_ERROR)
+		for (i = best; i < best + page_cnt; i++)
+			if (!bitmap_test (pool->used_map, i)) {
+				bitmap_mark (pool->used_map, i);
+				pool_adjust_free (pool, -1);
+			}
+	lock_release (&pool->lock);
+
+	return best != BITMAP_ERROR ? pool->base + PGSIZE * best : NULL;
+}
+
+/* Finds PAGE_CNT contiguous free pages in POOL, marks them used and
+   returns the index of the first one, or BITMAP_ERROR.  POOL's lock
+   must be held. */
+static size_t
+pool_scan_and_take (struct pool *pool, size_t page_cnt) {
+	size_t page_idx;
+
+	ASSERT (lock_held_by_current_thread (&pool->lock));
+
+	page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	if (page_idx != BITMAP_ERROR)
+		pool_adjust_free (pool, -(long) page_cnt);
+	return page_idx;
+}
+
+/* Adds DELTA to POOL's count of free pages.  Pages are freed without
+   the pool lock (sometimes with interrupts off, from the scheduler),
+   so the count is protected by disabling interrupts. */
+static void
+pool_adjust_free (struct pool *pool, long delta) {
+	enum intr_level old_level = intr_disable ();
+	pool->free_cnt += delta;
+	intr_set_level (old_level);
+}
+
+/* Lends PAGE_CNT contiguous pages of LENDER to the other pool, if
+   LENDER still has more than its low watermark free afterwards.
+   Returns the pages, or a null pointer. */
+static void *
+borrow_pages (struct pool *lender, size_t page_cnt) {
+	enum intr_level old_level;
+	size_t page_idx = BITMAP_ERROR;
+
+	if (lender->used_map == NULL)
+		return NULL;
+
+	lock_acquire (&lender->lock);
+	if (lender->free_cnt >= lender->reserve + page_cnt)
+		page_idx = pool_scan_and_take (lender, page_cnt);
+	lock_release (&lender->lock);
+	if (page_idx == BITMAP_ERROR)
+		return NULL;
+
+	old_level = intr_disable ();
+	bitmap_set_multiple (lender->lent_map, page_idx, page_cnt, true);
+	lender->lent_out += page_cnt;
+	lender->lent_total += page_cnt;
+	intr_set_level (old_level);
+	return lender->base + PGSIZE * page_idx;
+}
+
+/* Pops a page off POOL's pre-zeroed stack.  Returns a null pointer
+   if the stack is empty. */
+static void *
+take_zeroed_page (struct pool *pool) {
+	enum intr_level old_level = intr_disable ();
+	void *page = pool->zeroed_cnt > 0 ? pool->zeroed[--pool->zeroed_cnt] : NULL;
+	intr_set_level (old_level);
+	return page;
+}
+
+/* Gives every page on POOL's pre-zeroed stack back to its bitmap,
+   so that a contiguous request can use them.  POOL's lock must be
+   held.  Returns true if any page was released. */
+static bool
+release_zeroed_pages (struct pool *pool) {
+	bool released = false;
+	void *page;
+
+	ASSERT (lock_held_by_current_thread (&pool->lock));
+
+	while ((page = take_zeroed_page (pool)) != NULL) {
+		bitmap_reset (pool->used_map, pg_no (page) - pg_no (pool->base));
+		pool_adjust_free (pool, 1);
+		released = true;
+	}
+	return released;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -336,15 +684,23 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
      and subtract it from the pool's size. */
 	uint64_t pgcnt = (end - start) / PGSIZE;
 	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	size_t sum_pages =
+		DIV_ROUND_UP (bitmap_summary_size (pgcnt), PGSIZE) * PGSIZE;
 
 	lock_init(&p->lock);
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	p->lent_map = bitmap_create_in_buf (pgcnt, *bm_base + bm_pages, bm_pages);
+	bitmap_add_summary (p->used_map, *bm_base + 2 * bm_pages, sum_pages);
 	p->base = (void *) start;
+	p->free_cnt = 0;
+	p->zeroed_cnt = 0;
+	p->lent_out = 0;
+	p->lent_total = 0;
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
 
-	*bm_base += bm_pages;
+	*bm_base += 2 * bm_pages + sum_pages;
 }
 
 /* Returns true if PAGE was allocated from POOL,
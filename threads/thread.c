@@ -355,7 +355,10 @@ thread_get_recent_cpu (void) {
    to it to enable thread_start() to continue, and immediately
    blocks.  After that, the idle thread never appears in the
    ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   special case when the ready list is empty.
+
+   While nothing else is runnable, the idle thread also fills the
+   page allocator's pre-zeroed page stacks. */
 static void
 idle (void *idle_started_ UNUSED) {
 	struct semaphore *idle_started = idle_started_;
@@ -368,6 +371,16 @@ idle (void *idle_started_ UNUSED) {
 		intr_disable ();
 		thread_block ();
 
+		/* Nobody else wants the CPU, so zero free pages ahead of
+		   time for later PAL_ZERO allocations.  Stop as soon as
+		   another thread becomes ready. */
+		intr_enable ();
+		while (list_empty (&ready_list) && palloc_prezero_page ())
+			continue;
+		intr_disable ();
+		if (!list_empty (&ready_list))
+			continue;
+
 		/* Re-enable interrupts and wait for the next one.
 
 		   The `sti' instruction disables interrupts until the
@@ -13,6 +13,7 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
@@ -574,11 +575,24 @@ install_page (void *upage, void *kpage, bool writable) {
  * If you want to implement the function for only project 2, implement it on the
  * upper block. */
 
+/* Fills PAGE, on its first fault, from the file region that AUX, a
+ * struct lazy_load, describes, and then frees AUX.  The frame lock is
+ * dropped for the read. */
 static bool
 lazy_load_segment (struct page *page, void *aux) {
-	/* TODO: Load the segment from the file */
-	/* TODO: This called when the first page fault occurs on address VA. */
-	/* TODO: VA is available when calling this function. */
+	struct lazy_load *load = aux;
+	uint8_t *kva = page->frame->kva;
+	bool success;
+
+	vm_io_begin ();
+	success = file_read_at (load->file, kva, load->read_bytes, load->ofs)
+		== (off_t) load->read_bytes;
+	vm_io_end ();
+	memset (kva + load->read_bytes, 0, PGSIZE - load->read_bytes);
+
+	file_close (load->file);
+	free (load);
+	return success;
 }
 
 /* Loads a segment starting at offset OFS in FILE at address
@@ -609,31 +623,64 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		void *aux = NULL;
-		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
+		/* A page with nothing to read is just a zeroed anonymous page.
+		 * A read-only page is file-backed: it never needs swap, and
+		 * processes running the same program share its frame. */
+		struct lazy_load *aux = NULL;
+		enum vm_type type = VM_ANON;
+		vm_initializer *init = NULL;
+		if (page_read_bytes > 0) {
+			aux = malloc (sizeof *aux);
+			if (aux == NULL)
+				return false;
+			aux->file = file_reopen (file);
+			aux->ofs = ofs;
+			aux->read_bytes = page_read_bytes;
+			if (aux->file == NULL) {
+				free (aux);
+				return false;
+			}
+			type = writable ? VM_ANON : VM_FILE | VM_SEGMENT;
+			init = writable ? lazy_load_segment : file_lazy_load;
+		}
+		if (!vm_alloc_page_with_initializer (type, upage, writable, init,
+					aux)) {
+			if (aux != NULL) {
+				file_close (aux->file);
+				free (aux);
+			}
 			return false;
+		}
 
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
 		upage += PGSIZE;
+		ofs += page_read_bytes;
 	}
 	return true;
 }
 
-/* Create a PAGE of stack at the USER_STACK. Return true on success. */
+/* Number of stack pages set up front with -populate. */
+#define STACK_POPULATE 8
+
+/* Create a PAGE of stack at the USER_STACK. Return true on success.
+ * With -populate, sets up STACK_POPULATE pages instead, and loads the
+ * whole program, which load () has laid out by now, along with them. */
 static bool
 setup_stack (struct intr_frame *if_) {
-	bool success = false;
+	size_t page_cnt = vm_populate_all ? STACK_POPULATE : 1;
 	void *stack_bottom = (void *) (((uint8_t *) USER_STACK) - PGSIZE);
+	size_t i;
 
-	/* TODO: Map the stack on stack_bottom and claim the page immediately.
-	 * TODO: If success, set the rsp accordingly.
-	 * TODO: You should mark the page is stack. */
-	/* TODO: Your code goes here */
-
-	return success;
+	for (i = 0; i < page_cnt; i++)
+		if (!vm_alloc_page (VM_ANON | VM_STACK,
+					(uint8_t *) USER_STACK - (i + 1) * PGSIZE, true))
+			return false;
+	if (vm_populate_all ? !vm_populate (NULL, (void *) USER_STACK)
+			: !vm_claim_page (stack_bottom))
+		return false;
+	if_->rsp = USER_STACK;
+	return true;
 }
 #endif /* VM */
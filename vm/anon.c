@@ -2,6 +2,13 @@
 
 #include "vm/vm.h"
 #include "devices/disk.h"
+#include <bitmap.h>
+#include <stdio.h>
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "vm/zswap.h"
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,36 +24,300 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* Swap space is divided into page-sized slots of SLOT_SECTORS
+ * sectors each.  Slots are handed out a cluster of SWAP_CLUSTER
+ * consecutive slots at a time: pages evicted one after another, as
+ * vm_get_frame () does in batches, land in consecutive slots and are
+ * written with one sequential sweep of the disk instead of a seek
+ * per page.  When no whole cluster is free, any free slot will do.
+ *
+ * A page keeps its slot after it is swapped back in, and is mapped
+ * read-only until it is first written.  Evicting it again before
+ * then costs no I/O; the first write frees the slot (see
+ * anon_release_swap ()).
+ *
+ * Swapping a page in also reads ahead: pages of the same process that
+ * sit in the next few slots were most likely evicted together with it,
+ * and will most likely be wanted together again.  They are read into
+ * frames that stay unmapped (see vm_cache_page ()) until their own
+ * fault maps them without I/O.  The window grows by one slot for each
+ * such page that is used, and shrinks by one for each that is evicted
+ * or freed unused.  Pages under madvise () hints ignore the window:
+ * MADV_RANDOM reads nothing ahead, and MADV_SEQUENTIAL reads RA_MAX.
+ *
+ * In front of all this sits the compressed cache of zswap.c: a page
+ * that compresses well is kept there instead of being written, and
+ * reaches the disk only if the cache has to make room.
+ *
+ * Swapping in and out runs with the frame lock held, but drops it for
+ * the disk transfers: the frames involved are marked busy, and anyone
+ * else who needs them waits until the transfer is done. */
+#define SLOT_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
+#define SWAP_CLUSTER 16
+
+/* Bounds and initial size of the readahead window, in slots. */
+#define RA_MIN 1
+#define RA_MAX 16
+#define RA_INIT 4
+
+static struct bitmap *swap_map;     /* Used slots. */
+static struct page **slot_page;     /* Page in each used slot. */
+static size_t ra_window = RA_INIT;  /* Slots to read ahead. */
+static struct lock swap_lock;       /* Protects SWAP_MAP and the cursor. */
+static size_t cluster_next;         /* Next slot of the current cluster. */
+static size_t cluster_left;         /* Slots left in the current cluster. */
+
+/* Statistics. */
+static long long swap_out_cnt;      /* # of pages written to swap. */
+static long long swap_clean_cnt;    /* # of evictions that reused a slot. */
+static long long swap_in_cnt;       /* # of pages read from swap. */
+static long long swap_release_cnt;  /* # of slots freed on first write. */
+static long long ra_cnt;            /* # of pages read ahead. */
+static long long ra_hit_cnt;        /* # of those that were used. */
+
+static size_t slot_alloc (struct page *);
+static void slot_free (size_t slot);
+static void slot_write (size_t slot, const void *data);
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	size_t slot_cnt;
+
+	swap_disk = disk_get (1, 1);
+	slot_cnt = swap_disk != NULL ? disk_size (swap_disk) / SLOT_SECTORS : 0;
+	lock_init (&swap_lock);
+	swap_map = bitmap_create (slot_cnt);
+	slot_page = calloc (slot_cnt, sizeof *slot_page);
+	if (swap_map == NULL || (slot_cnt > 0 && slot_page == NULL))
+		PANIC ("vm_anon_init: out of memory for the swap map");
+}
+
+/* Prints swap statistics. */
+void
+anon_print_stats (void) {
+	printf ("Swap: %lld pages out, %lld evicted without writing, %lld in, "
+			"%lld slots freed on write\n",
+			swap_out_cnt, swap_clean_cnt, swap_in_cnt, swap_release_cnt);
+	printf ("Swap: %lld pages read ahead, %lld used, window %zu\n",
+			ra_cnt, ra_hit_cnt, ra_window);
 }
 
 /* Initialize the file mapping */
 bool
-anon_initializer (struct page *page, enum vm_type type, void *kva) {
+anon_initializer (struct page *page, enum vm_type type, void *kva UNUSED) {
 	/* Set up the handler */
 	page->operations = &anon_ops;
 
 	struct anon_page *anon_page = &page->anon;
+	anon_page->type = type;
+	anon_page->slot = BITMAP_ERROR;
+	anon_page->zentry = NULL;
+	return true;
+}
+
+/* Reads swap slot SLOT into KVA. */
+static void
+slot_read (size_t slot, void *kva) {
+	size_t i;
+
+	for (i = 0; i < SLOT_SECTORS; i++)
+		disk_read (swap_disk, slot * SLOT_SECTORS + i,
+				(uint8_t *) kva + i * DISK_SECTOR_SIZE);
 }
 
 /* Swap in the page by read contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+	struct page *ahead[RA_MAX];
+	size_t ahead_cnt = 0;
+	size_t slot = anon_page->slot;
+	size_t window = ra_window;
+	size_t i;
+
+	if (anon_page->zentry != NULL) {
+		zswap_load (page, kva);
+		return true;
+	}
+	ASSERT (slot != BITMAP_ERROR);
+
+	/* Keep the slot until the first write. */
+	page->write_protect = page->writable;
+
+	/* Read ahead the same process's pages in the slots that follow.
+	 * The swap map only changes under the frame lock, which our caller
+	 * holds, so SLOT_PAGE can be read without the swap lock. */
+	if (page->advice == MADV_RANDOM)
+		window = 0;
+	else if (page->advice == MADV_SEQUENTIAL)
+		window = RA_MAX;
+	for (i = 1; i <= window && slot + i < bitmap_size (swap_map); i++) {
+		struct page *next = slot_page[slot + i];
+
+		if (next == NULL || next->owner != page->owner || next->frame != NULL)
+			continue;
+		if (vm_cache_page (next) == NULL)
+			break;
+		ahead[ahead_cnt++] = next;
+	}
+
+	/* Read the page and those ahead of it in one sweep. */
+	vm_io_begin ();
+	slot_read (slot, kva);
+	for (i = 0; i < ahead_cnt; i++)
+		slot_read (ahead[i]->anon.slot, ahead[i]->frame->kva);
+	vm_io_end ();
+	swap_in_cnt++;
+
+	for (i = 0; i < ahead_cnt; i++) {
+		ahead[i]->write_protect = ahead[i]->writable;
+		vm_cache_page_done (ahead[i]);
+		ra_cnt++;
+	}
+	return true;
+}
+
+/* Adjusts the readahead window after a page read ahead was either
+ * mapped by a fault, if HIT, or evicted or freed before that. */
+void
+anon_readahead_feedback (bool hit) {
+	if (hit) {
+		ra_hit_cnt++;
+		if (ra_window < RA_MAX)
+			ra_window++;
+	} else if (ra_window > RA_MIN)
+		ra_window--;
 }
 
 /* Swap out the page by writing contents to the swap disk. */
 static bool
 anon_swap_out (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	/* The slot still matches the frame unless the page was written. */
+	if (anon_page->slot != BITMAP_ERROR
+			&& !pml4_is_dirty (page->owner->pml4, page->va)) {
+		swap_clean_cnt++;
+		return true;
+	}
+
+	if (zswap_store (page, page->frame->kva)) {
+		/* Whatever the slot held is stale now. */
+		if (anon_page->slot != BITMAP_ERROR) {
+			slot_free (anon_page->slot);
+			anon_page->slot = BITMAP_ERROR;
+		}
+		return true;
+	}
+
+	if (anon_page->slot == BITMAP_ERROR) {
+		anon_page->slot = slot_alloc (page);
+		if (anon_page->slot == BITMAP_ERROR)
+			return false;
+	}
+	vm_io_begin ();
+	slot_write (anon_page->slot, page->frame->kva);
+	vm_io_end ();
+	swap_out_cnt++;
+	return true;
+}
+
+/* Writes DATA, the contents of anonymous page PAGE, to PAGE's swap
+ * slot, allocating one if it has none.  Returns false if swap is
+ * full.  Used by zswap to write back pages from its cache, which it
+ * does with the frame lock held throughout. */
+bool
+anon_swap_write (struct page *page, const void *data) {
+	struct anon_page *anon_page = &page->anon;
+
+	if (anon_page->slot == BITMAP_ERROR) {
+		anon_page->slot = slot_alloc (page);
+		if (anon_page->slot == BITMAP_ERROR)
+			return false;
+	}
+	slot_write (anon_page->slot, data);
+	swap_out_cnt++;
+	return true;
+}
+
+/* Writes DATA to swap slot SLOT. */
+static void
+slot_write (size_t slot, const void *data) {
+	size_t i;
+
+	for (i = 0; i < SLOT_SECTORS; i++)
+		disk_write (swap_disk, slot * SLOT_SECTORS + i,
+				(const uint8_t *) data + i * DISK_SECTOR_SIZE);
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	if (anon_page->slot != BITMAP_ERROR)
+		slot_free (anon_page->slot);
+	zswap_drop (page);
+}
+
+/* Frees the swap slot of PAGE, an anonymous page that is in memory
+ * and about to be written, so that its copy on disk is stale. */
+void
+anon_release_swap (struct page *page) {
+	struct anon_page *anon_page = &page->anon;
+
+	ASSERT (page->operations == &anon_ops);
+
+	if (anon_page->slot != BITMAP_ERROR) {
+		slot_free (anon_page->slot);
+		anon_page->slot = BITMAP_ERROR;
+		swap_release_cnt++;
+	}
+}
+
+/* Allocates a swap slot for PAGE, the next one of the current cluster
+ * if possible, and returns it, or BITMAP_ERROR if swap is full. */
+static size_t
+slot_alloc (struct page *page) {
+	size_t slot;
+
+	lock_acquire (&swap_lock);
+	if (cluster_left == 0 || bitmap_test (swap_map, cluster_next)) {
+		/* Start a new cluster, aligned so clusters never overlap. */
+		size_t cluster_cnt = bitmap_size (swap_map) / SWAP_CLUSTER;
+		size_t i;
+
+		cluster_left = 0;
+		for (i = 0; i < cluster_cnt; i++) {
+			size_t start = (cluster_next / SWAP_CLUSTER + 1 + i)
+				% cluster_cnt * SWAP_CLUSTER;
+			if (!bitmap_contains (swap_map, start, SWAP_CLUSTER, true)) {
+				cluster_next = start;
+				cluster_left = SWAP_CLUSTER;
+				break;
+			}
+		}
+	}
+
+	if (cluster_left > 0) {
+		slot = cluster_next++;
+		cluster_left--;
+		bitmap_mark (swap_map, slot);
+	} else
+		slot = bitmap_scan_and_flip (swap_map, 0, 1, false);
+	if (slot != BITMAP_ERROR)
+		slot_page[slot] = page;
+	lock_release (&swap_lock);
+	return slot;
+}
+
+/* Frees swap slot SLOT. */
+static void
+slot_free (size_t slot) {
+	lock_acquire (&swap_lock);
+	ASSERT (bitmap_test (swap_map, slot));
+	bitmap_reset (swap_map, slot);
+	slot_page[slot] = NULL;
+	lock_release (&swap_lock);
 }
@@ -1,6 +1,13 @@
 /* file.c: Implementation of memory backed file object (mmaped object). */
 
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
 #include "vm/vm.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/vaddr.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
@@ -14,45 +21,478 @@ static const struct page_operations file_ops = {
 	.type = VM_FILE,
 };
 
+/* The frame cache: frames that hold file data, keyed by the inode and
+ * offset of the data.  A process that faults on a file-
+ * backed page whose data is already in such a frame maps that frame
+ * instead of reading a copy of its own.  For read-only segments, this
+ * is most often the text of a program another process is running.
+ * For mmap, it makes every mapping of a file page, in any process,
+ * see the same frame, so one process's writes show in the others' at
+ * once.  The pages sharing a frame are chained from it, which lets
+ * eviction unmap all of them, and the frame is written back once if
+ * any of them wrote to it.  Segments and mappings are kept apart, so
+ * that writes through a mapping never reach a running program's text.
+ * Every mapping of a file page reads up to the end of the page or the
+ * file, whichever comes first, so they all agree on where the data
+ * ends.  A segment page may end its data earlier, and must see zeros
+ * after that; if it does not end where the cached frame's data does,
+ * it gets a frame of its own.
+ * A frame leaves the cache when it is evicted or its last page is
+ * freed.  Entries only exist while some page maps the frame, and so
+ * holds the file open, so the inode pointers in the keys stay valid.
+ * FRAME_LOCK protects the cache. */
+struct fcache_entry {
+	struct hash_elem elem;
+	struct inode *inode;
+	off_t ofs;
+	size_t read_bytes;          /* Bytes of file data; the rest is zeros. */
+	bool segment;               /* For a program segment, not mmap? */
+	struct frame *frame;
+};
+
+static struct hash fcache;
+
+/* Statistics. */
+static long long fcache_add_cnt;    /* # of frames put in the cache. */
+static long long fcache_hit_cnt;    /* # of pages mapped from it. */
+static long long fcache_shared_cnt; /* # of those that were mmap pages. */
+static long long wb_page_cnt;       /* # of pages written back. */
+static long long wb_write_cnt;      /* # of writes that took. */
+
+/* Writeback of a range, as at munmap, exit or msync, gathers each run
+ * of dirty pages that are adjacent in both memory and the file, up to
+ * WB_CLUSTER pages, into WB_BUF and writes it with one file_write_at (),
+ * so the file system sees one request for up to 8 * WB_CLUSTER
+ * consecutive sectors.  Without WB_BUF, pages are written one by one.
+ * FRAME_LOCK protects WB_BUF. */
+#define WB_CLUSTER 8
+static uint8_t *wb_buf;
+
+/* A run of dirty pages being gathered. */
+struct wb_run {
+	struct page *pages[WB_CLUSTER];
+	size_t cnt;
+};
+
+static uint64_t
+fcache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct fcache_entry *c = hash_entry (e, struct fcache_entry, elem);
+	uint64_t key[2] = { (uint64_t) c->inode, (uint64_t) c->ofs };
+
+	return hash_bytes (key, sizeof key);
+}
+
+static bool
+fcache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct fcache_entry *a = hash_entry (a_, struct fcache_entry, elem);
+	const struct fcache_entry *b = hash_entry (b_, struct fcache_entry, elem);
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	if (a->ofs != b->ofs)
+		return a->ofs < b->ofs;
+	return a->segment < b->segment;
+}
+
 /* The initializer of file vm */
 void
 vm_file_init (void) {
+	hash_init (&fcache, fcache_hash, fcache_less, NULL);
+	wb_buf = palloc_get_multiple (0, WB_CLUSTER);
+}
+
+/* Prints file-backed page statistics. */
+void
+file_print_stats (void) {
+	printf ("File: %lld frames cached, %lld pages mapped from the cache, "
+			"%lld of them mmap pages\n", fcache_add_cnt, fcache_hit_cnt,
+			fcache_shared_cnt);
+	printf ("File: %lld pages written back in %lld writes\n",
+			wb_page_cnt, wb_write_cnt);
 }
 
-/* Initialize the file backed page */
+/* Initialize the file backed page.  Where it reads from is filled in
+ * by mmap_load (), which runs right after. */
 bool
-file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
+file_backed_initializer (struct page *page, enum vm_type type,
+		void *kva UNUSED) {
 	/* Set up the handler */
 	page->operations = &file_ops;
 
 	struct file_page *file_page = &page->file;
+	file_page->file = NULL;
+	file_page->ofs = 0;
+	file_page->read_bytes = 0;
+	file_page->type = type;
+	return true;
+}
+
+/* Moves the file region that AUX, a struct lazy_load, describes into
+ * PAGE, which takes over AUX's file; AUX is freed. */
+static void
+file_page_set (struct page *page, struct lazy_load *load) {
+	struct file_page *file_page = &page->file;
+
+	file_page->file = load->file;
+	file_page->ofs = load->ofs;
+	file_page->read_bytes = load->read_bytes;
+	free (load);
+}
+
+/* Reads PAGE's part of its file into KVA, and zeros the rest.  Runs
+ * from swap_in (), and drops FRAME_LOCK for the read. */
+static bool
+file_page_read (struct page *page, void *kva) {
+	struct file_page *file_page = &page->file;
+	size_t read_bytes = file_page->read_bytes;
+	off_t bytes_read;
+
+	vm_io_begin ();
+	bytes_read = file_read_at (file_page->file, kva, read_bytes,
+			file_page->ofs);
+	vm_io_end ();
+	if (bytes_read != (off_t) read_bytes)
+		return false;
+	memset ((uint8_t *) kva + read_bytes, 0, PGSIZE - read_bytes);
+	return true;
+}
+
+/* Returns true if PAGE is in memory and it, or any page sharing its
+ * frame, was written since the frame was last written back.  With
+ * CLEAR, also clears their dirty bits. */
+static bool
+frame_test_dirty (struct page *page, bool clear) {
+	bool dirty = false;
+	struct page *p;
+
+	if (page->frame == NULL)
+		return false;
+	for (p = page->frame->page; p != NULL; p = p->next_sharer) {
+		if (!pml4_is_dirty (p->owner->pml4, p->va))
+			continue;
+		dirty = true;
+		if (!clear)
+			break;
+		pml4_set_dirty (p->owner->pml4, p->va, false);
+	}
+	return dirty;
+}
+
+/* Writes PAGE back to its file if the user wrote to it, through it or
+ * through another page sharing its frame, and returns true if it did.
+ * PAGE may still be mapped, as it is when kswapd cleans it ahead of
+ * eviction, so the dirty bits are cleared before the write: a store
+ * that races with it marks the frame dirty again. */
+bool
+file_page_write_back (struct page *page) {
+	struct file_page *file_page = &page->file;
+
+	if (!frame_test_dirty (page, true))
+		return false;
+	file_write_at (file_page->file, page->frame->kva, file_page->read_bytes,
+			file_page->ofs);
+	wb_page_cnt++;
+	wb_write_cnt++;
+	return true;
+}
+
+/* Writes back the pages of RUN, if any, and empties it. */
+static void
+wb_flush (struct wb_run *run) {
+	struct page *first, *last;
+	size_t i;
+
+	if (run->cnt == 0)
+		return;
+	if (run->cnt == 1 || wb_buf == NULL) {
+		for (i = 0; i < run->cnt; i++)
+			file_page_write_back (run->pages[i]);
+		run->cnt = 0;
+		return;
+	}
+
+	/* As in file_page_write_back (), clear before copying. */
+	for (i = 0; i < run->cnt; i++) {
+		struct page *page = run->pages[i];
+
+		frame_test_dirty (page, true);
+		memcpy (wb_buf + i * PGSIZE, page->frame->kva, PGSIZE);
+	}
+	first = run->pages[0];
+	last = run->pages[run->cnt - 1];
+	file_write_at (first->file.file, wb_buf,
+			(run->cnt - 1) * PGSIZE + last->file.read_bytes, first->file.ofs);
+	wb_page_cnt += run->cnt;
+	wb_write_cnt++;
+	run->cnt = 0;
+}
+
+/* Adds PAGE to the run in RUN_, a struct wb_run, if it is a dirty
+ * file-backed page, writing the run back first if PAGE does not
+ * continue it. */
+static bool
+wb_gather (struct page *page, void *run_) {
+	struct wb_run *run = run_;
+	struct page *prev = run->cnt > 0 ? run->pages[run->cnt - 1] : NULL;
+
+	if (VM_TYPE (page->operations->type) != VM_FILE
+			|| !frame_test_dirty (page, false)) {
+		wb_flush (run);
+		return true;
+	}
+	if (prev != NULL
+			&& (run->cnt == WB_CLUSTER
+				|| page->va != (uint8_t *) prev->va + PGSIZE
+				|| prev->file.read_bytes != PGSIZE
+				|| page->file.ofs != prev->file.ofs + PGSIZE
+				|| file_get_inode (page->file.file)
+					!= file_get_inode (prev->file.file)))
+		wb_flush (run);
+	run->pages[run->cnt++] = page;
+	return true;
+}
+
+/* Writes back the pages of SPT in [START, END) that the user wrote
+ * to, a run of adjacent pages at a time.  FRAME_LOCK must be held. */
+void
+file_write_back_range (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	struct wb_run run;
+
+	run.cnt = 0;
+	spt_for_each (spt, start, end, wb_gather, &run);
+	wb_flush (&run);
 }
 
 /* Swap in the page by read contents from the file. */
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
-	struct file_page *file_page UNUSED = &page->file;
+	return file_page_read (page, kva);
 }
 
-/* Swap out the page by writeback contents to the file. */
+/* Swap out the page by writeback contents to the file.  The caller
+ * has marked the frame busy, so FRAME_LOCK is dropped for the write. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	if (!frame_test_dirty (page, true))
+		return true;
+	vm_io_begin ();
+	file_write_at (file_page->file, page->frame->kva, file_page->read_bytes,
+			file_page->ofs);
+	vm_io_end ();
+	wb_page_cnt++;
+	wb_write_cnt++;
+	return true;
 }
 
 /* Destory the file backed page. PAGE will be freed by the caller. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	file_page_write_back (page);
+	file_close (file_page->file);
+}
+
+/* Fills PAGE, a file-backed page on its first fault, from the file
+ * region that AUX, a struct lazy_load, describes.  PAGE takes over
+ * AUX's file, and AUX is freed. */
+bool
+file_lazy_load (struct page *page, void *aux) {
+	file_page_set (page, aux);
+	return file_page_read (page, page->frame->kva);
+}
+
+/* Turns PAGE, if it is a pending file-backed page, into a file-backed
+ * page without reading anything, for a frame that already holds its
+ * contents. */
+bool
+file_backed_adopt (struct page *page) {
+	struct uninit_page *uninit = &page->uninit;
+	struct lazy_load *load = uninit->aux;
+
+	if (VM_TYPE (page->operations->type) != VM_UNINIT)
+		return true;
+	ASSERT (VM_TYPE (uninit->type) == VM_FILE && uninit->init == file_lazy_load);
+	if (!uninit->page_initializer (page, uninit->type, NULL))
+		return false;
+	file_page_set (page, load);
+	return true;
+}
+
+/* Returns the key of PAGE's data in the frame cache in *KEY, if PAGE is
+ * a file-backed page, pending or not, that reads anything from its
+ * file.  A page wholly past the end of its file, or a segment's zero
+ * page, has no data to share and gets a private zero frame. */
+static bool
+fcache_key (struct page *page, struct fcache_entry *key) {
+	if (page_get_type (page) != VM_FILE)
+		return false;
+	if (VM_TYPE (page->operations->type) == VM_UNINIT) {
+		struct lazy_load *load = page->uninit.aux;
+
+		key->inode = file_get_inode (load->file);
+		key->ofs = load->ofs;
+		key->read_bytes = load->read_bytes;
+		key->segment = (page->uninit.type & VM_SEGMENT) != 0;
+	} else {
+		key->inode = file_get_inode (page->file.file);
+		key->ofs = page->file.ofs;
+		key->read_bytes = page->file.read_bytes;
+		key->segment = (page->file.type & VM_SEGMENT) != 0;
+	}
+	return key->read_bytes > 0;
+}
+
+/* Returns a frame that holds PAGE's data, if PAGE is file-backed and
+ * some other page has its data cached, or a null pointer.  The frame
+ * may still be being read. */
+struct frame *
+fcache_find (struct page *page) {
+	struct fcache_entry key, *c;
+	struct hash_elem *e;
+
+	if (!fcache_key (page, &key) || (e = hash_find (&fcache, &key.elem)) == NULL)
+		return NULL;
+	c = hash_entry (e, struct fcache_entry, elem);
+	if (c->read_bytes != key.read_bytes)
+		return NULL;
+	return c->frame;
+}
+
+/* Counts PAGE, just mapped from the cache, in the statistics. */
+void
+fcache_hit (struct page *page) {
+	struct fcache_entry key;
+
+	fcache_hit_cnt++;
+	if (fcache_key (page, &key) && !key.segment)
+		fcache_shared_cnt++;
+}
+
+/* Puts FRAME, which is being filled for its only page, in the cache
+ * if that page is file-backed.  Until the frame is filled, pages that
+ * look it up wait for it rather than read their own copy. */
+void
+fcache_add (struct frame *frame) {
+	struct fcache_entry key, *c;
+
+	ASSERT (frame->cache == NULL && frame->page_cnt == 1);
+
+	if (!fcache_key (frame->page, &key)
+			|| hash_find (&fcache, &key.elem) != NULL
+			|| (c = malloc (sizeof *c)) == NULL)
+		return;
+	*c = key;
+	c->frame = frame;
+	hash_insert (&fcache, &c->elem);
+	frame->cache = c;
+	fcache_add_cnt++;
+}
+
+/* Takes FRAME out of the cache, if it is there. */
+void
+fcache_remove (struct frame *frame) {
+	if (frame->cache == NULL)
+		return;
+	hash_delete (&fcache, &frame->cache->elem);
+	free (frame->cache);
+	frame->cache = NULL;
 }
 
-/* Do the mmap */
+/* Do the mmap.  Maps LENGTH bytes of FILE from OFFSET at ADDR, lazily,
+ * one page at a time.  The last page holds the file up to its own end,
+ * even past LENGTH, as any other mapping of that page does; the bytes
+ * past the end of FILE read as zeros and are never written back.  With
+ * MAP_POPULATE in FLAGS, the whole mapping is read in, in file order,
+ * before returning.  Returns ADDR,
+ * or a null pointer if the range is not page-aligned, not free user
+ * memory, or FILE is empty. */
 void *
-do_mmap (void *addr, size_t length, int writable,
+do_mmap (void *addr, size_t length, bool writable, int flags,
 		struct file *file, off_t offset) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *upage = addr;
+	uint8_t *end;
+	off_t file_bytes;
+
+	if (addr == NULL || pg_ofs (addr) != 0 || offset % PGSIZE != 0
+			|| length == 0 || offset < 0)
+		return NULL;
+	end = upage + ROUND_UP (length, PGSIZE);
+	if (end <= upage || !is_user_vaddr (addr) || !is_user_vaddr (end - 1)
+			|| !spt_range_empty (spt, addr, end))
+		return NULL;
+	file_bytes = file_length (file) - offset;
+	if (file_bytes <= 0)
+		return NULL;
+
+	for (; upage < end; upage += PGSIZE) {
+		enum vm_type type = VM_FILE | (upage == addr ? VM_MMAP_HEAD : 0);
+		struct lazy_load *load = malloc (sizeof *load);
+
+		if (load == NULL)
+			goto fail;
+		load->file = file_reopen (file);
+		load->ofs = offset;
+		load->read_bytes = file_bytes < PGSIZE ? file_bytes : PGSIZE;
+		if (load->file == NULL
+				|| !vm_alloc_page_with_initializer (type, upage, writable,
+					file_lazy_load, load)) {
+			file_close (load->file);
+			free (load);
+			goto fail;
+		}
+		/* Pages past the end of FILE still each get their own offset. */
+		offset += PGSIZE;
+		file_bytes -= load->read_bytes;
+	}
+
+	/* What does not fit stays lazy. */
+	if (flags & MAP_POPULATE)
+		vm_populate (addr, end);
+	return addr;
+
+fail:
+	spt_remove_range (spt, addr, upage);
+	return NULL;
 }
 
-/* Do the munmap */
+/* Returns true if PAGE belongs to a file mapping, and sets *HEAD to
+ * whether it is the first page of one. */
+static bool
+is_mmap_page (struct page *page, bool *head) {
+	if (VM_TYPE (page->operations->type) == VM_UNINIT) {
+		*head = (page->uninit.type & VM_MMAP_HEAD) != 0;
+		return VM_TYPE (page->uninit.type) == VM_FILE
+			&& (page->uninit.type & VM_SEGMENT) == 0;
+	}
+	if (page_get_type (page) != VM_FILE)
+		return false;
+	*head = (page->file.type & VM_MMAP_HEAD) != 0;
+	return (page->file.type & VM_SEGMENT) == 0;
+}
+
+/* Do the munmap.  ADDR must be the address a mapping was made at;
+ * the mapping ends before the next page that does not belong to a
+ * mapping or that starts another one.  Pages the user wrote to are
+ * written back. */
 void
 do_munmap (void *addr) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct page *page = spt_find_page (spt, addr);
+	uint8_t *end = addr;
+	bool head;
+
+	if (page == NULL || page->va != addr || !is_mmap_page (page, &head)
+			|| !head)
+		return;
+	do
+		end += PGSIZE;
+	while ((page = spt_find_page (spt, end)) != NULL
+			&& is_mmap_page (page, &head) && !head);
+	spt_remove_range (spt, addr, end);
 }
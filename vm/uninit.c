@@ -8,8 +8,12 @@
  * function.
  * */
 
+#include <string.h>
 #include "vm/vm.h"
 #include "vm/uninit.h"
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/vaddr.h"
 
 static bool uninit_initialize (struct page *page, void *kva);
 static void uninit_destroy (struct page *page);
@@ -51,7 +55,10 @@ uninit_initialize (struct page *page, void *kva) {
 	vm_initializer *init = uninit->init;
 	void *aux = uninit->aux;
 
-	/* TODO: You may need to fix this function. */
+	/* An anonymous page that nothing fills starts out zeroed. */
+	if (init == NULL && VM_TYPE (uninit->type) == VM_ANON)
+		memset (kva, 0, PGSIZE);
+
 	return uninit->page_initializer (page, uninit->type, kva) &&
 		(init ? init (page, aux) : true);
 }
@@ -62,7 +69,11 @@ uninit_initialize (struct page *page, void *kva) {
  * PAGE will be freed by the caller. */
 static void
 uninit_destroy (struct page *page) {
-	struct uninit_page *uninit UNUSED = &page->uninit;
-	/* TODO: Fill this function.
-	 * TODO: If you don't have anything to do, just return. */
+	struct uninit_page *uninit = &page->uninit;
+	struct lazy_load *load = uninit->aux;
+
+	if (load != NULL) {
+		file_close (load->file);
+		free (load);
+	}
 }
@@ -1,8 +1,235 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
+#include <bitmap.h>
+#include <hash.h>
+#include <intrinsic.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
+#include "vm/zswap.h"
+
+/* The frame table: every frame that holds a user page.  FRAME_LOCK
+ * protects the table and the links between frames and pages.
+ *
+ * FRAME_LOCK is not held across disk I/O.  A frame that is being read
+ * in or written out is marked busy with frame_io_begin () first, which
+ * also pins it, and the page operations then drop the lock around the
+ * transfer itself with vm_io_begin () and vm_io_end ().  Its pages stay
+ * linked to it meanwhile.  A thread that needs such a page, or finds
+ * the frame in the file frame cache, waits on FRAME_IO_COND until
+ * frame_io_end () says the frame is settled, and then looks again,
+ * since it may have been evicted or freed in between.  Only the
+ * owner of a page ever waits for it; daemons skip busy frames.
+ *
+ * The table is also the clock for eviction.  CLOCK_HAND points at the
+ * next frame to examine; new frames go in just behind it, so they are
+ * examined last. */
+static struct list frame_table;
+static struct lock frame_lock;
+static struct list_elem *clock_hand;
+static size_t frame_cnt;            /* # of frames in FRAME_TABLE. */
+static struct condition frame_io_cond;  /* A busy frame was settled. */
+static long long io_wait_cnt;       /* # of waits for a busy frame. */
+
+/* Frame replacement policy, chosen with -vm-policy. */
+enum vm_policy vm_policy = VM_POLICY_CLOCK;
+
+/* 2Q replacement (Johnson and Shasha, VLDB '94).
+ *
+ * A page faulted in for the first time goes on A1IN, a FIFO that
+ * holds at most about a quarter of the frames, and is evicted from
+ * there in order whether or not it was touched again.  Evicted pages
+ * are remembered on the ghost list.  A page that faults again while
+ * it is still a ghost has proven it is reused, and goes on AM, which
+ * is managed like the clock.  A one-off scan through a big mapping
+ * thus only churns A1IN and cannot flush the working set out of AM.
+ *
+ * The ghost list is kept under both policies, so that the refault
+ * count in vm_print_stats () can compare them: a refault is a fault on
+ * a page that was evicted less than about half a memory's worth of
+ * evictions ago, i.e. an eviction the policy should not have made.
+ * Run the same workload with -vm-policy=clock and -vm-policy=2q and
+ * compare refaults per eviction; the hit rate of the resident set is
+ * one minus refaults over faults. */
+enum frame_queue {
+	FQ_NONE,                        /* Not on a 2Q queue. */
+	FQ_A1IN,                        /* On A1IN. */
+	FQ_AM                           /* On AM. */
+};
+static struct list a1in, am;
+static size_t a1in_cnt;             /* # of frames on A1IN. */
+
+/* Ghost list: pages evicted recently, oldest first. */
+static struct list ghost_list;
+static size_t ghost_cnt;
+
+/* Eviction statistics. */
+static long long refault_cnt;       /* # of faults on ghost pages. */
+static long long evict_clean_cnt;   /* # of victims that were clean. */
+static long long evict_dirty_cnt;   /* # of victims that were dirty. */
+static long long clock_scan_cnt;    /* # of frames the hand passed. */
+
+/* Number of frames to evict at once when the user pool runs dry. */
+#define EVICT_BATCH 8
+
+/* Fault-around: a fault on a page read from a file also reads and maps
+ * the other pages of the same aligned window of FAULT_AROUND pages that
+ * come from the same file at the matching offsets, as long as free
+ * memory lasts. */
+#define FAULT_AROUND 16
+static long long fault_around_cnt;  /* # of pages mapped by fault-around. */
+
+/* Pages under MADV_SEQUENTIAL fault around this many pages ahead of
+ * the fault instead, and pages under MADV_RANDOM not at all. */
+#define FAULT_AHEAD 64
+
+/* MADV_WILLNEED requests, which the prefetchd thread reads in, in
+ * order, from free memory.  Started on the first request. */
+struct prefetch {
+	struct list_elem elem;
+	struct supplemental_page_table *spt;
+	void *start, *end;
+};
+static struct list prefetch_queue;  /* Protected by FRAME_LOCK. */
+static struct prefetch *prefetch_cur;  /* The one being read, or null. */
+static struct semaphore prefetch_sema;  /* Ups once per request. */
+static bool prefetchd_started;
+static long long prefetch_cnt;      /* # of pages read in by prefetchd. */
+static long long dontneed_cnt;      /* # of pages dropped by MADV_DONTNEED. */
+
+/* Load whole programs at exec, chosen with -populate. */
+bool vm_populate_all;
+static long long populate_cnt;      /* # of pages loaded by vm_populate (). */
+
+/* The zero page: one frame of zeros, mapped read-only wherever a
+ * never-written anonymous page is read.  Such a page stays pending,
+ * with no frame of its own, until its first write faults it in. */
+static void *zero_page;
+static long long zero_map_cnt;      /* # of read faults it served. */
+static long long zero_fill_cnt;     /* # of pages written after that. */
+
+/* Background reclaim.  When an allocation leaves fewer than WMARK_LOW
+ * user pages free, it wakes kswapd, which evicts EVICT_BATCH frames at
+ * a time until WMARK_HIGH are free, so that faults seldom have to
+ * evict for themselves.  Before going back to sleep, it also writes
+ * back the dirty file-backed pages among the next KSWAPD_CLEAN frames
+ * the hand will reach, leaving them mapped, so that their eviction
+ * costs no I/O. */
+#define KSWAPD_CLEAN 32
+static size_t wmark_low, wmark_high;
+static struct semaphore kswapd_sema;
+static bool kswapd_awake;           /* Protected by FRAME_LOCK. */
+static long long kswapd_wake_cnt;   /* # of times kswapd was woken. */
+static long long bg_reclaim_cnt;    /* # of frames kswapd freed. */
+static long long bg_clean_cnt;      /* # of pages kswapd wrote back. */
+static long long direct_reclaim_cnt;  /* # of frames faults freed. */
+
+/* Resident set limits, set with -rss-limit.  Each process counts its
+ * pages in memory in its supplemental page table.  A process at
+ * VM_RSS_LIMIT pages, or, with VM_RSS_AUTO and memory short, at a
+ * margin over its working set, evicts one of its own pages for each
+ * new one instead of taking a frame from everyone else.
+ *
+ * With VM_RSS_AUTO, wssd samples the accessed bits of every frame
+ * each WSS_PERIOD ticks and counts the pages each process touched.  A
+ * process's working set is the most it touched in any of the last
+ * WSS_WINDOW periods.  The sampler clears the bits it reads, but
+ * records them in the frame for the replacement policy. */
+size_t vm_rss_limit;
+bool vm_rss_auto;
+#define WSS_PERIOD 25
+#define WSS_SLACK 32
+static unsigned wss_epoch;          /* Current sample period. */
+static long long wss_sample_cnt;    /* # of sample periods. */
+static long long local_reclaim_cnt; /* # of frames processes took from
+                                       themselves. */
+
+/* Transparent huge pages, turned on with -thp.  When a write faults on
+ * a never-written anonymous page, and every page of the 2 MB-aligned
+ * region around it is one too, the whole region is given THP_PAGES
+ * physically contiguous, 2 MB-aligned frames at once and mapped with
+ * a single 2 MB page, so that the rest of the region never faults and
+ * takes one TLB entry.  If no such frames are free, the page gets a
+ * 4 kB frame as usual.
+ *
+ * Each page keeps its own frame, and the frames remember their huge
+ * page, so everything else in the VM still works on 4 kB frames.
+ * Whatever needs to treat one of them alone first splits the huge page
+ * back into 4 kB mappings: eviction, unmapping part of the region,
+ * MADV_DONTNEED, fork, and compaction, which leaves them alone.  The
+ * replacement policy looks only at a huge page's first frame, whose
+ * accessed bit is the 2 MB page's. */
+bool vm_thp;
+#define THP_PAGES (LARGE_PGSIZE / PGSIZE)
+
+/* A 2 MB mapping of anonymous pages. */
+struct thp {
+	struct list_elem elem;      /* Element in THP_LIST. */
+	struct thread *owner;       /* Whose address space it is in. */
+	void *va;                   /* User address, 2 MB-aligned. */
+	void *kva;                  /* Kernel address of its first frame. */
+	size_t frame_cnt;           /* # of its frames not yet freed. */
+};
+
+static struct list thp_list;        /* Protected by FRAME_LOCK. */
+static long long thp_alloc_cnt;     /* # of huge pages mapped. */
+static long long thp_fallback_cnt;  /* # of times no 2 MB was free. */
+static long long thp_split_cnt;     /* # of huge pages split. */
+
+/* Kernel same-page merging, turned on with -ksm.
+ *
+ * The ksmd thread walks the frame table KSM_BATCH frames at a time,
+ * KSM_PERIOD timer ticks apart, and checksums each anonymous frame.  A
+ * frame whose checksum has not changed since the last visit is taken
+ * to be stable and goes in KSM_TREE, keyed by checksum.  When another
+ * stable frame turns up with the same checksum, both are write-
+ * protected and compared, and if they are equal, the pages of one move
+ * to the other.  They then share it as pages share a frame after fork,
+ * and the first write to one of them splits it off in vm_handle_wp (). */
+bool vm_ksm;
+#define KSM_BATCH 64
+#define KSM_PERIOD 10
+static struct hash ksm_tree;
+static struct list_elem *ksm_cursor;  /* Next frame for ksmd to visit. */
+static long long ksm_scan_cnt;      /* # of frames checksummed. */
+static long long ksm_merge_cnt;     /* # of pages merged. */
+static long long ksm_split_cnt;     /* # of merged pages split again. */
+
+/* Copy-on-write statistics. */
+static long long cow_share_cnt;     /* # of pages shared at fork. */
+static long long cow_copy_cnt;      /* # of shared pages copied on write. */
+
+/* Makes the kernel, too, fault on writes to read-only user pages, so
+ * that the copy-on-write of a page happens before a system call writes
+ * to it on the user's behalf. */
+#define CR0_WP (1 << 16)
+
+/* Compaction statistics. */
+static long long compact_cnt;       /* # of ranges cleared. */
+static long long compact_fail_cnt;  /* # of ranges that could not be. */
+static long long migrate_cnt;       /* # of frames migrated. */
+
+static hash_hash_func ksm_hash;
+static hash_less_func ksm_less;
+static thread_func ksm_daemon;
+static thread_func kswapd;
+static thread_func wss_daemon;
+static void kswapd_wake (void);
+static void ksm_remove (struct frame *);
+static bool thp_claim (struct page *);
+static void thp_split (struct thp *);
+static void thp_split_at (struct supplemental_page_table *, void *va);
+static void frame_io_begin (struct frame *);
+static void frame_io_end (struct frame *);
+static bool page_io_wait (struct page *);
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -15,7 +242,74 @@ vm_init (void) {
 #endif
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
-	/* TODO: Your code goes here. */
+	list_init (&frame_table);
+	lock_init (&frame_lock);
+	cond_init (&frame_io_cond);
+	clock_hand = list_end (&frame_table);
+	list_init (&a1in);
+	list_init (&am);
+	list_init (&ghost_list);
+	zswap_init ();
+	zero_page = palloc_get_page (PAL_ZERO);
+	lcr0 (rcr0 () | CR0_WP);
+	ksm_cursor = list_end (&frame_table);
+	list_init (&prefetch_queue);
+	sema_init (&prefetch_sema, 0);
+	wmark_low = palloc_user_page_cnt () / 64;
+	if (wmark_low < EVICT_BATCH)
+		wmark_low = EVICT_BATCH;
+	wmark_high = wmark_low * 2;
+	sema_init (&kswapd_sema, 0);
+	list_init (&thp_list);
+	thread_create ("kswapd", PRI_DEFAULT, kswapd, NULL);
+	if (vm_rss_auto)
+		thread_create ("wssd", PRI_DEFAULT, wss_daemon, NULL);
+	if (vm_ksm) {
+		hash_init (&ksm_tree, ksm_hash, ksm_less, NULL);
+		thread_create ("ksmd", PRI_DEFAULT, ksm_daemon, NULL);
+	}
+}
+
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	long long evict_cnt = evict_clean_cnt + evict_dirty_cnt;
+	long long scans_x100 = evict_cnt ? clock_scan_cnt * 100 / evict_cnt : 0;
+
+	printf ("VM: %lld evictions (%lld clean, %lld dirty), "
+			"%lld.%02lld frames scanned per eviction\n",
+			evict_cnt, evict_clean_cnt, evict_dirty_cnt,
+			scans_x100 / 100, scans_x100 % 100);
+	printf ("VM: %s replacement, %lld refaults of recently evicted pages\n",
+			vm_policy == VM_POLICY_2Q ? "2Q" : "clock", refault_cnt);
+	printf ("VM: %lld compactions (%lld failed), %lld frames migrated\n",
+			compact_cnt, compact_fail_cnt, migrate_cnt);
+	printf ("VM: %lld waits for frames under I/O\n", io_wait_cnt);
+	printf ("VM: kswapd woke %lld times, freed %lld frames and wrote back "
+			"%lld pages; faults freed %lld frames directly\n",
+			kswapd_wake_cnt, bg_reclaim_cnt, bg_clean_cnt,
+			direct_reclaim_cnt);
+	if (vm_thp)
+		printf ("VM: %lld huge pages mapped, %lld fell back to 4 kB pages, "
+				"%lld split\n", thp_alloc_cnt, thp_fallback_cnt, thp_split_cnt);
+	if (vm_rss_limit != 0 || vm_rss_auto)
+		printf ("VM: %lld frames reclaimed by processes at their resident "
+				"set limit, %lld working set samples\n",
+				local_reclaim_cnt, wss_sample_cnt);
+	printf ("VM: %lld pages shared copy-on-write at fork, %lld copied\n",
+			cow_share_cnt, cow_copy_cnt);
+	printf ("VM: %lld pages mapped by fault-around\n", fault_around_cnt);
+	printf ("VM: %lld reads served by the zero page, %lld of them written "
+			"later\n", zero_map_cnt, zero_fill_cnt);
+	printf ("VM: madvise read in %lld pages and dropped %lld\n",
+			prefetch_cnt, dontneed_cnt);
+	printf ("VM: %lld pages populated ahead of use\n", populate_cnt);
+	if (vm_ksm)
+		printf ("VM: ksmd checksummed %lld frames, merged %lld pages, "
+				"split %lld\n", ksm_scan_cnt, ksm_merge_cnt, ksm_split_cnt);
+	anon_print_stats ();
+	zswap_print_stats ();
+	file_print_stats ();
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -34,8 +328,28 @@ page_get_type (struct page *page) {
 
 /* Helpers */
 static struct frame *vm_get_victim (void);
+static bool rss_at_limit (struct supplemental_page_table *);
+static struct frame *rss_get_victim (struct supplemental_page_table *);
 static bool vm_do_claim_page (struct page *page);
 static struct frame *vm_evict_frame (void);
+static struct frame *evict_frame (struct frame *);
+static void vm_free_frame (struct frame *);
+static size_t vm_reclaim (size_t page_cnt);
+static struct frame *frame_create (void *kva);
+static void frame_setup (struct frame *, void *kva);
+static void frame_link (struct frame *, struct page *);
+static void frame_unlink (struct frame *, struct page *);
+static void frame_migrate (struct frame *, void *kva);
+static bool claim_locked (struct page *);
+static bool claim_frame (struct page *, struct frame *);
+static bool claim_cached (struct page *);
+static struct inode *page_file_pos (struct page *, off_t *ofs);
+static void fault_around (struct page *, struct inode *, off_t ofs);
+static void spt_free_page (struct page *);
+static void frame_enqueue (struct frame *, bool hot);
+static void frame_dequeue (struct frame *);
+static void ghost_add (struct page *);
+static bool ghost_remove (struct page *);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -46,98 +360,1144 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	ASSERT (VM_TYPE(type) != VM_UNINIT)
 
-	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct thread *curr = thread_current ();
+	struct supplemental_page_table *spt = &curr->spt;
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
-		/* TODO: Create the page, fetch the initialier according to the VM type,
-		 * TODO: and then create "uninit" page struct by calling uninit_new. You
-		 * TODO: should modify the field after calling the uninit_new. */
+		bool (*initializer) (struct page *, enum vm_type, void *);
+		struct page *page;
+
+		switch (VM_TYPE (type)) {
+			case VM_ANON:
+				initializer = anon_initializer;
+				break;
+			case VM_FILE:
+				initializer = file_backed_initializer;
+				break;
+			default:
+				goto err;
+		}
 
-		/* TODO: Insert the page into the spt. */
+		page = malloc (sizeof *page);
+		if (page == NULL)
+			goto err;
+		uninit_new (page, pg_round_down (upage), init, type, aux, initializer);
+		page->owner = curr;
+		page->writable = writable;
+
+		if (!spt_insert_page (spt, page)) {
+			free (page);
+			goto err;
+		}
+		return true;
 	}
 err:
+	/* AUX still belongs to the caller. */
 	return false;
 }
 
+/* Radix tree geometry: every node has SPT_FANOUT slots, and there are
+ * SPT_LEVELS levels of nodes, the last being the leaves. */
+#define SPT_FANOUT 512
+#define SPT_LEVELS 4
+#define SPT_TOP (1ULL << (PML4SHIFT + 9))
+
+/* Returns the number of bytes of address space that a node at LEVEL
+ * covers; the root is at level 0. */
+static inline uint64_t
+spt_node_span (int level) {
+	return 1ULL << (PML4SHIFT + 9 - 9 * level);
+}
+
+/* Returns VA's slot index in a node at LEVEL. */
+static inline size_t
+spt_index (uint64_t va, int level) {
+	return (va >> (PML4SHIFT - 9 * level)) & (SPT_FANOUT - 1);
+}
+
+/* Returns the leaf slot for VA in SPT.  Missing nodes on the way are
+ * created if CREATE is true; otherwise, or if memory runs out, returns
+ * a null pointer. */
+static struct page **
+spt_slot (struct supplemental_page_table *spt, const void *va, bool create) {
+	void **slot = &spt->root;
+	int level;
+
+	for (level = 0; level < SPT_LEVELS; level++) {
+		void **node = *slot;
+
+		if (node == NULL) {
+			if (!create || (node = palloc_get_page (PAL_ZERO)) == NULL)
+				return NULL;
+			*slot = node;
+		}
+		slot = &node[spt_index ((uint64_t) va, level)];
+	}
+	return (struct page **) slot;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
-spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function. */
+spt_find_page (struct supplemental_page_table *spt, void *va) {
+	struct page **slot = spt_slot (spt, va, false);
 
-	return page;
+	return slot != NULL ? *slot : NULL;
 }
 
 /* Insert PAGE into spt with validation. */
 bool
-spt_insert_page (struct supplemental_page_table *spt UNUSED,
-		struct page *page UNUSED) {
-	int succ = false;
-	/* TODO: Fill this function. */
+spt_insert_page (struct supplemental_page_table *spt, struct page *page) {
+	struct page **slot;
+
+	ASSERT (pg_ofs (page->va) == 0);
 
-	return succ;
+	if (!is_user_vaddr (page->va))
+		return false;
+	slot = spt_slot (spt, page->va, true);
+	if (slot == NULL || *slot != NULL)
+		return false;
+	*slot = page;
+	return true;
 }
 
+/* Removes PAGE from SPT, unmaps it and frees it. */
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
-	vm_dealloc_page (page);
+	spt_remove_range (spt, page->va, page->va + PGSIZE);
+}
+
+/* Calls FUNC for each page in [START, END) below NODE, a node at LEVEL
+ * that covers the address space from BASE, in address order.  Returns
+ * false if FUNC stopped the walk. */
+static bool
+spt_walk (void **node, int level, uint64_t base, uint64_t start,
+		uint64_t end, spt_page_func *func, void *aux) {
+	uint64_t span = spt_node_span (level + 1);
+	size_t i = start > base ? (start - base) / span : 0;
+
+	for (; i < SPT_FANOUT && base + i * span < end; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1) {
+			if (!func (node[i], aux))
+				return false;
+		} else if (!spt_walk (node[i], level + 1, base + i * span,
+					start, end, func, aux))
+			return false;
+	}
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Calls FUNC with AUX for each page of SPT in [START, END), in address
+ * order, skipping empty subtrees without visiting them.  FUNC may
+ * remove the page it is given, but no other.  Returns false if FUNC
+ * returned false, which stops the walk. */
+bool
+spt_for_each (struct supplemental_page_table *spt, void *start, void *end,
+		spt_page_func *func, void *aux) {
+	if (spt->root == NULL)
+		return true;
+	return spt_walk (spt->root, 0, 0, (uint64_t) start, (uint64_t) end,
+			func, aux);
+}
+
+static bool
+stop_walk (struct page *page UNUSED, void *aux UNUSED) {
+	return false;
+}
+
+/* Returns true if SPT has no page in [START, END). */
+bool
+spt_range_empty (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	return spt_for_each (spt, start, end, stop_walk, NULL);
+}
+
+/* Removes the pages in [START, END) below the node in *SLOT, a node at
+ * LEVEL that covers the address space from BASE.  Each leaf's PTEs are
+ * cleared together, with a single page table walk, before its pages are
+ * freed.  Nodes that the range covers entirely are freed too. */
+static void
+spt_remove_node (void **slot, int level, uint64_t base, uint64_t start,
+		uint64_t end, uint64_t *pml4) {
+	void **node = *slot;
+	uint64_t span = spt_node_span (level + 1);
+	uint64_t lo = start > base ? start : base;
+	uint64_t hi = end < base + spt_node_span (level) ?
+		end : base + spt_node_span (level);
+	size_t i;
+
+	if (level == SPT_LEVELS - 1 && pml4 != NULL)
+		pml4_clear_range (pml4, (void *) lo, (hi - lo) / PGSIZE, NULL, NULL);
+
+	for (i = (lo - base) / span; i < SPT_FANOUT && base + i * span < hi; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1) {
+			spt_free_page (node[i]);
+			node[i] = NULL;
+		} else
+			spt_remove_node (&node[i], level + 1, base + i * span,
+					start, end, pml4);
+	}
+
+	if (lo == base && hi == base + spt_node_span (level)) {
+		palloc_free_page (node);
+		*slot = NULL;
+	}
+}
+
+/* Removes every page of SPT in [START, END), unmapping and freeing
+ * them and their frames.  File-backed pages the user wrote to are
+ * written back first, in runs.  SPT must belong to the running
+ * thread. */
+void
+spt_remove_range (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	ASSERT (spt == &thread_current ()->spt);
+	ASSERT (pg_ofs (start) == 0 && pg_ofs (end) == 0);
+
+	if (spt->root == NULL)
+		return;
+	lock_acquire (&frame_lock);
+	thp_split_at (spt, start);
+	thp_split_at (spt, end);
+	file_write_back_range (spt, start, end);
+	spt_remove_node (&spt->root, 0, 0, (uint64_t) start, (uint64_t) end,
+			thread_current ()->pml4);
+	lock_release (&frame_lock);
+}
+
+/* Frees PAGE, which is no longer mapped, and its frame unless other
+ * pages still share it.  FRAME_LOCK must be held. */
+static void
+spt_free_page (struct page *page) {
+	struct frame *frame;
+
+	/* An eviction that fails puts the mapping back. */
+	if (page_io_wait (page) && page->owner->pml4 != NULL)
+		pml4_clear_page (page->owner->pml4, page->va);
+	frame = page->frame;
+	ghost_remove (page);
+	if (frame != NULL && frame->page_cnt > 1) {
+		/* The others will not see that this page wrote the frame. */
+		if (page_get_type (page) == VM_FILE)
+			file_page_write_back (page);
+		frame_unlink (frame, page);
+		frame = NULL;
+	}
+	vm_dealloc_page (page);
+	if (frame != NULL) {
+		frame->page = NULL;
+		frame->page_cnt = 0;
+		vm_free_frame (frame);
+	}
+}
+
+/* Returns true if any page sharing FRAME was accessed since the last
+ * call, and clears their accessed bits. */
+static bool
+frame_test_accessed (struct frame *frame) {
+	bool accessed = frame->referenced;
+	struct page *p;
+
+	/* The huge page stands or falls with its first frame. */
+	if (frame->thp != NULL && frame->kva != frame->thp->kva)
+		return true;
+	frame->referenced = false;
+	for (p = frame->page; p != NULL; p = p->next_sharer) {
+		uint64_t *pml4 = p->owner->pml4;
+
+		if (pml4_is_accessed (pml4, p->va)) {
+			pml4_set_accessed (pml4, p->va, false);
+			accessed = true;
+		}
+	}
+	return accessed;
+}
+
+/* Returns true if any page sharing FRAME has written to it. */
+static bool
+frame_is_dirty (struct frame *frame) {
+	struct page *p;
+
+	for (p = frame->page; p != NULL; p = p->next_sharer)
+		if (pml4_is_dirty (p->owner->pml4, p->va))
+			return true;
+	return false;
+}
+
+/* Returns the clock policy's victim. */
 static struct frame *
-vm_get_victim (void) {
+clock_get_victim (void) {
 	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
+	size_t i;
 
+	/* Second chance, preferring clean pages: the hand clears the
+	 * accessed bit of each frame it passes, and stops at the first
+	 * frame that was neither accessed nor written, since that one can
+	 * go without any I/O.  Failing that, a full sweep settles for the
+	 * first unaccessed dirty frame it saw; if every frame had been
+	 * accessed, the second sweep finds their bits cleared. */
+	for (i = 0; i < 2 * frame_cnt; i++) {
+		struct frame *frame;
+
+		if (i == frame_cnt && victim != NULL)
+			break;
+		if (clock_hand == list_end (&frame_table))
+			clock_hand = list_begin (&frame_table);
+		frame = list_entry (clock_hand, struct frame, elem);
+		clock_hand = list_next (clock_hand);
+		clock_scan_cnt++;
+
+		if (frame->pin_cnt > 0 || frame_test_accessed (frame))
+			continue;
+		if (!frame_is_dirty (frame))
+			return frame;
+		if (victim == NULL)
+			victim = frame;
+	}
 	return victim;
 }
 
+/* Returns the 2Q policy's victim: the oldest frame on A1IN while A1IN
+ * is over its share, otherwise the first frame on AM that the clock
+ * finds unaccessed, cleaned pages first as in clock_get_victim (). */
+static struct frame *
+twoq_get_victim (void) {
+	size_t a1in_max = frame_cnt / 4 > 0 ? frame_cnt / 4 : 1;
+	size_t am_cnt = frame_cnt - a1in_cnt;
+	struct frame *victim = NULL;
+	struct list_elem *e;
+	size_t i;
+
+	if (a1in_cnt > a1in_max || list_empty (&am))
+		for (e = list_begin (&a1in); e != list_end (&a1in); e = list_next (e)) {
+			struct frame *frame = list_entry (e, struct frame, q_elem);
+
+			clock_scan_cnt++;
+			if (frame->pin_cnt == 0)
+				return frame;
+		}
+
+	for (i = 0; i < 2 * am_cnt && !list_empty (&am); i++) {
+		struct frame *frame;
+
+		if (i == am_cnt && victim != NULL)
+			break;
+		e = list_pop_front (&am);
+		list_push_back (&am, e);
+		frame = list_entry (e, struct frame, q_elem);
+		clock_scan_cnt++;
+
+		if (frame->pin_cnt > 0 || frame_test_accessed (frame))
+			continue;
+		if (!frame_is_dirty (frame))
+			return frame;
+		if (victim == NULL)
+			victim = frame;
+	}
+	if (victim != NULL)
+		return victim;
+
+	/* Everything on AM is pinned: take what A1IN has. */
+	for (e = list_begin (&a1in); e != list_end (&a1in); e = list_next (e)) {
+		struct frame *frame = list_entry (e, struct frame, q_elem);
+		if (frame->pin_cnt == 0)
+			return frame;
+	}
+	return NULL;
+}
+
+/* Get the struct frame, that will be evicted. */
+static struct frame *
+vm_get_victim (void) {
+	return vm_policy == VM_POLICY_2Q ? twoq_get_victim () : clock_get_victim ();
+}
+
+/* Puts FRAME, which was just filled, on the 2Q queue it belongs on:
+ * AM if its page is HOT, that is, faulted again soon after eviction,
+ * or A1IN otherwise.  Under the clock policy, the frame table is all
+ * there is. */
+static void
+frame_enqueue (struct frame *frame, bool hot) {
+	ASSERT (frame->queue == FQ_NONE);
+
+	if (vm_policy != VM_POLICY_2Q)
+		return;
+	if (hot) {
+		list_push_back (&am, &frame->q_elem);
+		frame->queue = FQ_AM;
+	} else {
+		list_push_back (&a1in, &frame->q_elem);
+		frame->queue = FQ_A1IN;
+		a1in_cnt++;
+	}
+}
+
+/* Takes FRAME off its 2Q queue, if any. */
+static void
+frame_dequeue (struct frame *frame) {
+	if (frame->queue == FQ_NONE)
+		return;
+	if (frame->queue == FQ_A1IN)
+		a1in_cnt--;
+	list_remove (&frame->q_elem);
+	frame->queue = FQ_NONE;
+}
+
+/* Remembers PAGE, just evicted, on the ghost list, forgetting the
+ * oldest ghosts beyond half the number of frames. */
+static void
+ghost_add (struct page *page) {
+	ASSERT (!page->ghost);
+
+	page->ghost = true;
+	list_push_back (&ghost_list, &page->ghost_elem);
+	ghost_cnt++;
+	while (ghost_cnt > frame_cnt / 2) {
+		struct page *old = list_entry (list_pop_front (&ghost_list),
+				struct page, ghost_elem);
+		old->ghost = false;
+		ghost_cnt--;
+	}
+}
+
+/* Forgets PAGE if it is on the ghost list, and returns true if it
+ * was. */
+static bool
+ghost_remove (struct page *page) {
+	if (!page->ghost)
+		return false;
+	page->ghost = false;
+	list_remove (&page->ghost_elem);
+	ghost_cnt--;
+	return true;
+}
+
+/* Swaps out PAGE, one of the pages in FRAME, and unlinks it from
+ * FRAME.  Sets *DIRTY if PAGE had written to the frame.  Returns false,
+ * leaving PAGE in place, if it could not be swapped out. */
+static bool
+page_evict (struct frame *frame, struct page *page, bool *dirty) {
+	uint64_t *pml4 = page->owner->pml4;
+	bool mapped, page_dirty;
+
+	/* Unmap first, so that the owner faults and waits for the busy
+	 * frame rather than writing to it while it is swapped out.  The
+	 * PTE keeps its dirty bit for swap_out () to look at. */
+	mapped = pml4_get_page (pml4, page->va) == frame->kva;
+	page_dirty = mapped && pml4_is_dirty (pml4, page->va);
+	pml4_clear_page (pml4, page->va);
+	if (!swap_out (page)) {
+		if (mapped) {
+			pml4_set_page (pml4, page->va, frame->kva,
+					page->writable && !page->write_protect);
+			pml4_set_dirty (pml4, page->va, page_dirty);
+		}
+		return false;
+	}
+
+	/* The bits now describe a copy that is gone. */
+	pml4_set_dirty (pml4, page->va, false);
+	pml4_set_accessed (pml4, page->va, false);
+
+	*dirty |= page_dirty;
+	ghost_remove (page);
+	ghost_add (page);
+	frame_unlink (frame, page);
+	return true;
+}
+
 /* Evict one page and return the corresponding frame.
  * Return NULL on error.*/
 static struct frame *
 vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
+	return evict_frame (vm_get_victim ());
+}
 
-	return NULL;
+/* Evicts the pages of VICTIM, if it is not null, and returns it, now
+ * free.  Returns NULL on error.  FRAME_LOCK must be held; it is
+ * dropped while the pages are written out. */
+static struct frame *
+evict_frame (struct frame *victim) {
+	bool dirty = false;
+
+	if (victim == NULL)
+		return NULL;
+	if (victim->thp != NULL)
+		thp_split (victim->thp);
+	ksm_remove (victim);
+
+	/* A frame shared copy-on-write is free only once each of its
+	 * pages has been swapped out, each to its own slot.  If one
+	 * fails, those already out stay out and the rest keep the frame.
+	 * The frame stays in the file frame cache until it is written
+	 * out, so that nobody reads a stale copy from the file meanwhile. */
+	frame_io_begin (victim);
+	while (victim->page != NULL)
+		if (!page_evict (victim, victim->page, &dirty)) {
+			frame_io_end (victim);
+			return NULL;
+		}
+	frame_io_end (victim);
+	fcache_remove (victim);
+
+	if (dirty)
+		evict_dirty_cnt++;
+	else
+		evict_clean_cnt++;
+	if (victim->readahead) {
+		victim->readahead = false;
+		anon_readahead_feedback (false);
+	}
+	frame_dequeue (victim);
+	victim->merged = false;
+	return victim;
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it. That is, if the user pool memory is full, this function
+ * evicts the frame to get the available memory space.  Returns NULL only
+ * if nothing can be evicted either.  FRAME_LOCK must be held; it is
+ * dropped while victims are written out.
+ *
+ * The frame is for PAGE.  If PAGE's process is at its resident set
+ * limit, the frame is one of its own pages', evicted. */
 static struct frame *
-vm_get_frame (void) {
+vm_get_frame (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
 	struct frame *frame = NULL;
-	/* TODO: Fill this function. */
+	void *kva;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (rss_at_limit (spt)) {
+		frame = evict_frame (rss_get_victim (spt));
+		if (frame != NULL) {
+			local_reclaim_cnt++;
+			return frame;
+		}
+	}
+
+	kva = palloc_get_page (PAL_USER);
+	kswapd_wake ();
+	if (kva == NULL) {
+		/* Make room for the next few faults too, so that anonymous
+		 * victims go out to consecutive swap slots back to back. */
+		frame = vm_evict_frame ();
+		if (frame != NULL) {
+			/* Others may run while the rest are written out. */
+			frame->pin_cnt++;
+			direct_reclaim_cnt += 1 + vm_reclaim (EVICT_BATCH - 1);
+			frame->pin_cnt--;
+		}
+		return frame;
+	}
+
+	frame = frame_create (kva);
+	ASSERT (frame == NULL || frame->page == NULL);
+	return frame;
+}
+
+/* Like vm_get_frame (), but for a page that is only expected to be
+ * used: never evicts, and returns NULL instead if PAGE's process is at
+ * its resident set limit or there is no free memory.  FRAME_LOCK must
+ * be held. */
+static struct frame *
+vm_try_get_frame (struct page *page) {
+	void *kva;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	if (rss_at_limit (&page->owner->spt))
+		return NULL;
+	kva = palloc_get_page (PAL_USER);
+	kswapd_wake ();
+	return kva != NULL ? frame_create (kva) : NULL;
+}
+
+/* Wraps KVA, a user pool page, in a new frame and adds it to the frame
+ * table.  Frees KVA and returns NULL if out of memory. */
+static struct frame *
+frame_create (void *kva) {
+	struct frame *frame = malloc (sizeof *frame);
+
+	if (frame == NULL) {
+		palloc_free_page (kva);
+		return NULL;
+	}
+	frame_setup (frame, kva);
 	return frame;
 }
 
+/* Initializes FRAME, just allocated, to wrap KVA, a user pool page,
+ * and adds it to the frame table. */
+static void
+frame_setup (struct frame *frame, void *kva) {
+	frame->kva = kva;
+	frame->page = NULL;
+	frame->page_cnt = 0;
+	frame->pin_cnt = 0;
+	frame->io = false;
+	frame->readahead = false;
+	frame->cache = NULL;
+	frame->merged = false;
+	frame->in_ksm_tree = false;
+	frame->ksm_sum = 0;
+	frame->queue = FQ_NONE;
+	frame->referenced = false;
+	frame->thp = NULL;
+	list_insert (clock_hand, &frame->elem);
+	frame_cnt++;
+}
+
+/* Gives PAGE, which is not in memory, a frame that is not mapped yet,
+ * for swap readahead: the page's next fault only has to map it.  Takes
+ * only free memory, within the resident set limit, and never evicts,
+ * since a guess is not worth a victim.  Returns the frame's kernel
+ * address for the caller to fill, or a null pointer.  The frame is
+ * busy until the caller calls vm_cache_page_done ().  FRAME_LOCK must
+ * be held, as it is in swap_in (). */
+void *
+vm_cache_page (struct page *page) {
+	struct frame *frame;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (page->frame == NULL);
+
+	frame = vm_try_get_frame (page);
+	if (frame == NULL)
+		return NULL;
+	frame_link (frame, page);
+	frame->readahead = true;
+	frame_enqueue (frame, false);
+	frame_io_begin (frame);
+	return frame->kva;
+}
+
+/* Marks the frame vm_cache_page () gave PAGE as filled. */
+void
+vm_cache_page_done (struct page *page) {
+	frame_io_end (page->frame);
+}
+
+/* Marks FRAME busy: it is about to be read or written without
+ * FRAME_LOCK, and must be neither evicted, migrated nor freed, nor its
+ * pages used, until frame_io_end ().  FRAME_LOCK must be held. */
+static void
+frame_io_begin (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (!frame->io);
+
+	frame->io = true;
+	frame->pin_cnt++;
+}
+
+/* Marks FRAME settled again and wakes whoever waits for it.
+ * FRAME_LOCK must be held. */
+static void
+frame_io_end (struct frame *frame) {
+	ASSERT (frame->io);
+
+	frame->io = false;
+	frame->pin_cnt--;
+	cond_broadcast (&frame_io_cond, &frame_lock);
+}
+
+/* Waits while PAGE is in a busy frame.  Returns true if it had to.
+ * PAGE must belong to the running thread, or to a process that cannot
+ * free it meanwhile.  FRAME_LOCK must be held. */
+static bool
+page_io_wait (struct page *page) {
+	bool waited = false;
+
+	while (page->frame != NULL && page->frame->io) {
+		cond_wait (&frame_io_cond, &frame_lock);
+		io_wait_cnt++;
+		waited = true;
+	}
+	return waited;
+}
+
+/* Called by the page operations around a disk transfer into or out of
+ * a busy frame: releases FRAME_LOCK, so that faults and daemons can go
+ * on meanwhile. */
+void
+vm_io_begin (void) {
+	lock_release (&frame_lock);
+}
+
+/* Takes FRAME_LOCK back after a disk transfer. */
+void
+vm_io_end (void) {
+	lock_acquire (&frame_lock);
+}
+
+/* Evicts up to PAGE_CNT frames and gives their memory back to the
+ * user pool.  Returns the number of frames freed.  FRAME_LOCK must be
+ * held. */
+static size_t
+vm_reclaim (size_t page_cnt) {
+	size_t i;
+
+	for (i = 0; i < page_cnt; i++) {
+		struct frame *frame = vm_evict_frame ();
+		if (frame == NULL)
+			break;
+		vm_free_frame (frame);
+	}
+	return i;
+}
+
+/* Brings SPT's working set samples up to the current period, zeroing
+ * those of the periods in which none of its pages were touched. */
+static void
+wss_roll (struct supplemental_page_table *spt) {
+	if (wss_epoch - spt->ws_epoch >= WSS_WINDOW) {
+		memset (spt->ws_sample, 0, sizeof spt->ws_sample);
+		spt->ws_epoch = wss_epoch;
+	}
+	while (spt->ws_epoch != wss_epoch) {
+		spt->ws_epoch++;
+		spt->ws_sample[spt->ws_epoch % WSS_WINDOW] = 0;
+	}
+}
+
+/* Returns SPT's working set estimate, in pages. */
+static size_t
+wss_estimate (struct supplemental_page_table *spt) {
+	size_t wss = 0;
+	int i;
+
+	wss_roll (spt);
+	for (i = 0; i < WSS_WINDOW; i++)
+		if (spt->ws_sample[i] > wss)
+			wss = spt->ws_sample[i];
+	return wss;
+}
+
+/* Returns true if SPT's process may have no more pages in memory than
+ * it has.  FRAME_LOCK must be held. */
+static bool
+rss_at_limit (struct supplemental_page_table *spt) {
+	if (vm_rss_limit != 0 && spt->rss >= vm_rss_limit)
+		return true;
+	if (vm_rss_auto && palloc_user_free_cnt () < wmark_high) {
+		size_t wss = wss_estimate (spt);
+		return spt->rss >= wss + wss / 4 + WSS_SLACK;
+	}
+	return false;
+}
+
+/* Returns a frame for SPT's process to take from itself: the first,
+ * from the clock hand on, that holds only a page of SPT and has not
+ * been accessed since it was last looked at.  Clears the accessed
+ * bits of SPT's frames it passes, but leaves the hand where it is.
+ * Returns NULL if SPT has no frame that could go. */
+static struct frame *
+rss_get_victim (struct supplemental_page_table *spt) {
+	struct list_elem *e = clock_hand;
+	struct frame *fallback = NULL;
+	size_t i;
+
+	for (i = 0; i < 2 * frame_cnt; i++) {
+		struct frame *frame;
+
+		if (e == list_end (&frame_table))
+			e = list_begin (&frame_table);
+		frame = list_entry (e, struct frame, elem);
+		e = list_next (e);
+
+		if (frame->pin_cnt > 0 || frame->page_cnt != 1
+				|| &frame->page->owner->spt != spt)
+			continue;
+		if (!frame_test_accessed (frame))
+			return frame;
+		if (fallback == NULL)
+			fallback = frame;
+	}
+	return fallback;
+}
+
+/* Wakes kswapd if free user memory has fallen below the low watermark
+ * and it is not awake already.  FRAME_LOCK must be held. */
+static void
+kswapd_wake (void) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (!kswapd_awake && palloc_user_free_cnt () < wmark_low) {
+		kswapd_awake = true;
+		kswapd_wake_cnt++;
+		sema_up (&kswapd_sema);
+	}
+}
+
+/* Writes back the dirty file-backed pages among the next KSWAPD_CLEAN
+ * frames from the clock hand that have not been accessed since the
+ * hand last passed them, which makes them the next victims.  Leaves
+ * the accessed bits alone, so the hand still sees them as they are.
+ * FRAME_LOCK must be held; it is dropped for the writes. */
+static void
+kswapd_clean (void) {
+	struct list_elem *e = clock_hand;
+	size_t i;
+
+	for (i = 0; i < KSWAPD_CLEAN && !list_empty (&frame_table); i++) {
+		struct frame *frame;
+		struct page *page;
+
+		if (e == list_end (&frame_table))
+			e = list_begin (&frame_table);
+		frame = list_entry (e, struct frame, elem);
+		e = list_next (e);
+
+		page = frame->page;
+		if (frame->pin_cnt > 0 || frame->page_cnt != 1
+				|| VM_TYPE (page->operations->type) != VM_FILE
+				|| pml4_is_accessed (page->owner->pml4, page->va)
+				|| !pml4_is_dirty (page->owner->pml4, page->va))
+			continue;
+
+		/* The page stays mapped; swap_out () only writes it back. */
+		frame_io_begin (frame);
+		swap_out (page);
+		frame_io_end (frame);
+		bg_clean_cnt++;
+		e = list_next (&frame->elem);
+	}
+}
+
+/* Background reclaim thread.  Sleeps until kswapd_wake () ups
+ * KSWAPD_SEMA, then evicts until WMARK_HIGH user pages are free,
+ * letting faults take FRAME_LOCK between batches. */
+static void
+kswapd (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&kswapd_sema);
+		lock_acquire (&frame_lock);
+		while (palloc_user_free_cnt () < wmark_high) {
+			size_t freed = vm_reclaim (EVICT_BATCH);
+
+			bg_reclaim_cnt += freed;
+			if (freed == 0)
+				break;
+			lock_release (&frame_lock);
+			thread_yield ();
+			lock_acquire (&frame_lock);
+		}
+		kswapd_clean ();
+		kswapd_awake = false;
+		lock_release (&frame_lock);
+	}
+}
+
+/* Working set sampler.  Every WSS_PERIOD ticks, starts a new sample
+ * period and credits each page that was accessed in the last one to
+ * its process. */
+static void
+wss_daemon (void *aux UNUSED) {
+	for (;;) {
+		struct list_elem *e;
+
+		timer_sleep (WSS_PERIOD);
+		lock_acquire (&frame_lock);
+		wss_epoch++;
+		wss_sample_cnt++;
+		for (e = list_begin (&frame_table); e != list_end (&frame_table);
+				e = list_next (e)) {
+			struct frame *frame = list_entry (e, struct frame, elem);
+			struct page *p;
+
+			for (p = frame->page; p != NULL; p = p->next_sharer) {
+				uint64_t *pml4 = p->owner->pml4;
+
+				if (!pml4_is_accessed (pml4, p->va))
+					continue;
+				/* A huge page's bit is its pages' bit too. */
+				if (frame->thp == NULL)
+					pml4_set_accessed (pml4, p->va, false);
+				frame->referenced = true;
+				wss_roll (&p->owner->spt);
+				p->owner->spt.ws_sample[wss_epoch % WSS_WINDOW]++;
+			}
+		}
+		for (e = list_begin (&thp_list); e != list_end (&thp_list);
+				e = list_next (e)) {
+			struct thp *thp = list_entry (e, struct thp, elem);
+
+			pml4_set_accessed (thp->owner->pml4, thp->va, false);
+		}
+		lock_release (&frame_lock);
+	}
+}
+
+/* Removes FRAME from the frame table and frees it along with its
+ * memory.  The caller must already have unmapped it.  FRAME_LOCK must
+ * be held. */
+static void
+vm_free_frame (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (!frame->io);
+
+	while (frame->page != NULL)
+		frame_unlink (frame, frame->page);
+	if (clock_hand == &frame->elem)
+		clock_hand = list_next (clock_hand);
+	if (ksm_cursor == &frame->elem)
+		ksm_cursor = list_next (ksm_cursor);
+	ksm_remove (frame);
+	if (frame->readahead)
+		anon_readahead_feedback (false);
+	fcache_remove (frame);
+	frame_dequeue (frame);
+	if (frame->thp != NULL && --frame->thp->frame_cnt == 0) {
+		list_remove (&frame->thp->elem);
+		free (frame->thp);
+	}
+	list_remove (&frame->elem);
+	frame_cnt--;
+	palloc_free_page (frame->kva);
+	free (frame);
+}
+
+/* Moves FRAME's contents to the free user page KVA, and repoints the
+ * mapping of FRAME's page there.  Interrupts stay off from the copy
+ * to the remapping, so the owner cannot write to the old copy in
+ * between.  FRAME_LOCK must be held. */
+static void
+frame_migrate (struct frame *frame, void *kva) {
+	enum intr_level old_level;
+	struct page *p;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	old_level = intr_disable ();
+	memcpy (kva, frame->kva, PGSIZE);
+	for (p = frame->page; p != NULL; p = p->next_sharer)
+		if (pml4_get_page (p->owner->pml4, p->va) == frame->kva)
+			pml4_move_page (p->owner->pml4, p->va, kva);
+	frame->kva = kva;
+	intr_set_level (old_level);
+	migrate_cnt++;
+}
+
+/* Makes room for PAGE_CNT contiguous pages in the user pool by
+ * migrating the user frames in the way to other pages, and returns the
+ * cleared range, already allocated, or a null pointer.  Called by
+ * palloc_get_multiple() when a multi-page PAL_USER request fails only
+ * because the pool is fragmented.
+ *
+ * Every frame in the frame table that is not pinned is movable: its
+ * page can be found through frame->page, and its only mapping is in
+ * its owner's page table.  palloc_claim_user_range() picks the range that needs the
+ * fewest moves. */
+void *
+vm_compact (size_t page_cnt) {
+	bool locked = lock_held_by_current_thread (&frame_lock);
+	struct bitmap *movable;
+	struct list_elem *e;
+	uint8_t *pages;
+	size_t start, i;
+
+	movable = bitmap_create (palloc_user_page_cnt ());
+	if (movable == NULL)
+		return NULL;
+	if (!locked)
+		lock_acquire (&frame_lock);
+
+	for (e = list_begin (&frame_table); e != list_end (&frame_table);
+			e = list_next (e)) {
+		struct frame *frame = list_entry (e, struct frame, elem);
+		size_t idx = palloc_user_page_idx (frame->kva);
+
+		if (idx != SIZE_MAX && frame->pin_cnt == 0 && frame->thp == NULL)
+			bitmap_mark (movable, idx);
+	}
+
+	pages = palloc_claim_user_range (page_cnt, movable);
+	if (pages != NULL) {
+		start = palloc_user_page_idx (pages);
+		for (e = list_begin (&frame_table); e != list_end (&frame_table);
+				e = list_next (e)) {
+			struct frame *frame = list_entry (e, struct frame, elem);
+			size_t idx = palloc_user_page_idx (frame->kva);
+			void *kva;
+
+			if (idx == SIZE_MAX || idx < start || idx >= start + page_cnt)
+				continue;
+
+			/* The whole range is in use now, so this page lies outside. */
+			kva = palloc_get_page (PAL_USER);
+			if (kva == NULL)
+				break;
+			frame_migrate (frame, kva);
+			bitmap_reset (movable, idx);
+		}
+
+		if (e != list_end (&frame_table)) {
+			/* Nowhere to move the rest: give back what was cleared. */
+			for (i = start; i < start + page_cnt; i++)
+				if (!bitmap_test (movable, i))
+					palloc_free_page (pages + (i - start) * PGSIZE);
+			pages = NULL;
+		}
+	}
+
+	if (pages != NULL)
+		compact_cnt++;
+	else
+		compact_fail_cnt++;
+	if (!locked)
+		lock_release (&frame_lock);
+	bitmap_destroy (movable);
+	return pages;
+}
+
+/* The stack may grow to this many bytes below USER_STACK. */
+#define STACK_MAX (1 << 20)
+
+/* Returns true if a fault at ADDR looks like an access to the stack
+ * just below the user's stack pointer, which PUSH may touch 8 bytes
+ * ahead of moving RSP. */
+static bool
+is_stack_access (struct intr_frame *f, void *addr, bool user) {
+	uint64_t va = (uint64_t) addr;
+
+	return user
+		&& va >= f->rsp - 8
+		&& va < USER_STACK
+		&& va >= USER_STACK - STACK_MAX;
+}
+
 /* Growing the stack. */
 static void
-vm_stack_growth (void *addr UNUSED) {
+vm_stack_growth (void *addr) {
+	void *upage = pg_round_down (addr);
+
+	if (vm_alloc_page (VM_ANON | VM_STACK, upage, true))
+		vm_claim_page (upage);
+}
+
+/* Gives PAGE a private copy of the frame it shares with other pages.
+ * The frame it leaves stays write-protected for the rest, until each
+ * of them writes and finds itself its last user.  If the others let go
+ * of the frame first, PAGE keeps it instead.  FRAME_LOCK must be held;
+ * it may be dropped on the way. */
+static bool
+cow_break (struct page *page) {
+	struct frame *shared, *frame;
+
+	for (;;) {
+		/* Do not let finding a frame evict the one to copy. */
+		shared = page->frame;
+		shared->pin_cnt++;
+		frame = vm_get_frame (page);
+		shared->pin_cnt--;
+		if (frame == NULL)
+			return false;
+		if (page->frame == shared && shared->page_cnt > 1)
+			break;
+
+		/* The other sharers wrote or exited while victims went out. */
+		vm_free_frame (frame);
+		if (page->frame == NULL || page->frame->page_cnt == 1)
+			return true;
+	}
+
+	memcpy (frame->kva, shared->kva, PGSIZE);
+	frame_unlink (shared, page);
+	frame_link (frame, page);
+	frame_enqueue (frame, false);
+	if (shared->merged)
+		ksm_split_cnt++;
+	else
+		cow_copy_cnt++;
+	return true;
+}
+
+/* Handle the fault on write_protected page: PAGE is writable, but was
+ * mapped read-only to catch its first write.  Swapped-in anonymous
+ * pages are, so that their swap slot can be freed right then, and so
+ * are pages that share a frame with another process since fork, which
+ * get a copy of their own. */
+static bool
+vm_handle_wp (struct page *page) {
+	bool success = true;
+
+	lock_acquire (&frame_lock);
+	page_io_wait (page);
+	if (page->frame != NULL && page->write_protect) {
+		if (page->frame->page_cnt > 1)
+			success = cow_break (page);
+		if (success && page->frame != NULL) {
+			if (page_get_type (page) == VM_ANON)
+				anon_release_swap (page);
+			page->write_protect = false;
+			pml4_set_page (page->owner->pml4, page->va, page->frame->kva, true);
+		}
+	}
+	lock_release (&frame_lock);
+
+	/* If the page was evicted meanwhile, the retry faults it back. */
+	return success;
 }
 
-/* Handle the fault on write_protected page */
+/* Returns true if PAGE is an anonymous page that was never loaded and
+ * starts out as zeros.  While it is mapped at all, it is mapped to the
+ * zero page. */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
+is_zero_fill (struct page *page) {
+	return VM_TYPE (page->operations->type) == VM_UNINIT
+		&& VM_TYPE (page->uninit.type) == VM_ANON
+		&& page->uninit.init == NULL;
 }
 
 /* Return true on success */
 bool
-vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
-		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
+vm_try_handle_fault (struct intr_frame *f, void *addr,
+		bool user, bool write, bool not_present) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
 	struct page *page = NULL;
-	/* TODO: Validate the fault */
-	/* TODO: Your code goes here */
+	struct inode *inode;
+	off_t ofs;
+	bool success;
 
-	return vm_do_claim_page (page);
+	if (addr == NULL || !is_user_vaddr (addr))
+		return false;
+
+	page = spt_find_page (spt, addr);
+	if (page == NULL) {
+		if (!is_stack_access (f, addr, user))
+			return false;
+		vm_stack_growth (addr);
+		page = spt_find_page (spt, addr);
+		return page != NULL && page->frame != NULL;
+	}
+
+	if (write && !page->writable)
+		return false;
+	if (!not_present) {
+		if (!write)
+			return false;
+		if (!is_zero_fill (page))
+			return vm_handle_wp (page);
+		/* A write to the zero page: load the page for real below. */
+		zero_fill_cnt++;
+	} else if (!write && zero_page != NULL && is_zero_fill (page)) {
+		zero_map_cnt++;
+		return pml4_set_page (page->owner->pml4, page->va, zero_page, false);
+	}
+
+	/* Loading a pending page frees its record of where it came from. */
+	lock_acquire (&frame_lock);
+	inode = page_file_pos (page, &ofs);
+	success = claim_locked (page);
+	if (success && inode != NULL)
+		fault_around (page, inode, ofs);
+	lock_release (&frame_lock);
+	return success;
 }
 
 /* Free the page.
@@ -150,41 +1510,843 @@ vm_dealloc_page (struct page *page) {
 
 /* Claim the page that allocate on VA. */
 bool
-vm_claim_page (void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function */
+vm_claim_page (void *va) {
+	struct page *page = spt_find_page (&thread_current ()->spt, va);
 
 	return vm_do_claim_page (page);
 }
 
-/* Claim the PAGE and set up the mmu. */
+/* Claim the PAGE and set up the mmu.  The frame is filled before it is
+ * mapped, so the user never sees it half-loaded. */
 static bool
 vm_do_claim_page (struct page *page) {
-	struct frame *frame = vm_get_frame ();
+	bool success;
+
+	if (page == NULL)
+		return false;
+
+	lock_acquire (&frame_lock);
+	success = claim_locked (page);
+	lock_release (&frame_lock);
+	return success;
+}
+
+/* Does the work of vm_do_claim_page () with FRAME_LOCK already held.
+ * The lock may be dropped and retaken on the way. */
+static bool
+claim_locked (struct page *page) {
+	struct frame *frame;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	for (;;) {
+		/* Let a read or write-out of PAGE, or of the cached frame
+		 * that holds its data, finish first. */
+		page_io_wait (page);
+		frame = fcache_find (page);
+		if (frame != NULL && frame->io) {
+			cond_wait (&frame_io_cond, &frame_lock);
+			io_wait_cnt++;
+			continue;
+		}
+
+		if (page->frame != NULL) {
+			/* Read ahead or prefetched: only the mapping is missing. */
+			frame = page->frame;
+			if (frame->readahead) {
+				frame->readahead = false;
+				anon_readahead_feedback (true);
+			}
+			if (ghost_remove (page))
+				refault_cnt++;
+			return pml4_set_page (page->owner->pml4, page->va, frame->kva,
+					page->writable && !page->write_protect);
+		}
+
+		if (claim_cached (page) || thp_claim (page))
+			return true;
+		frame = vm_get_frame (page);
+		if (frame == NULL)
+			return false;
+
+		/* Evicting for the frame let others at PAGE meanwhile. */
+		if (page->frame == NULL && fcache_find (page) == NULL)
+			return claim_frame (page, frame);
+		vm_free_frame (frame);
+	}
+}
+
+/* Returns true if PAGE could be part of a huge page, counting it in
+ * *AUX, a size_t, and false, stopping the walk, if not. */
+static bool
+thp_check (struct page *page, void *aux) {
+	if (!is_zero_fill (page) || !page->writable)
+		return false;
+	++*(size_t *) aux;
+	return true;
+}
+
+/* Maps PAGE, a never-written anonymous page, and the rest of the 2 MB
+ * around it with a huge page, if THP is on, the region holds nothing
+ * but such pages, and 2 MB of contiguous frames is free.  Returns
+ * false if it did not.  FRAME_LOCK must be held. */
+static bool
+thp_claim (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	uint64_t *pml4 = page->owner->pml4;
+	uint8_t *va = (uint8_t *) ((uint64_t) page->va & ~LARGE_PGMASK);
+	struct list frames;
+	struct thp *thp;
+	uint8_t *kva;
+	size_t cnt = 0, i;
+
+	if (!vm_thp || !is_zero_fill (page) || rss_at_limit (spt)
+			|| (vm_rss_limit != 0 && spt->rss + THP_PAGES > vm_rss_limit)
+			|| !spt_for_each (spt, va, va + LARGE_PGSIZE, thp_check, &cnt)
+			|| cnt != THP_PAGES)
+		return false;
+
+	/* Get every allocation out of the way before touching a page. */
+	kva = palloc_get_large (PAL_USER);
+	kswapd_wake ();
+	thp = kva != NULL ? malloc (sizeof *thp) : NULL;
+	list_init (&frames);
+	for (i = 0; thp != NULL && i < THP_PAGES; i++) {
+		struct frame *frame = malloc (sizeof *frame);
+
+		if (frame == NULL)
+			break;
+		list_push_back (&frames, &frame->elem);
+	}
+	if (thp == NULL || i < THP_PAGES) {
+		while (!list_empty (&frames))
+			free (list_entry (list_pop_front (&frames), struct frame, elem));
+		free (thp);
+		if (kva != NULL)
+			palloc_free_multiple (kva, THP_PAGES);
+		thp_fallback_cnt++;
+		return false;
+	}
+
+	/* Some pages may have been read, and mapped to the zero page. */
+	pml4_clear_range (pml4, va, THP_PAGES, NULL, NULL);
+	thp->owner = page->owner;
+	thp->va = va;
+	thp->kva = kva;
+	thp->frame_cnt = THP_PAGES;
+	list_push_back (&thp_list, &thp->elem);
+	for (i = 0; i < THP_PAGES; i++) {
+		struct frame *frame = list_entry (list_pop_front (&frames),
+				struct frame, elem);
+		struct page *p = spt_find_page (spt, va + i * PGSIZE);
+
+		frame_setup (frame, kva + i * PGSIZE);
+		frame->thp = thp;
+		frame_link (frame, p);
+		if (!swap_in (p, frame->kva))
+			NOT_REACHED ();
+		frame_enqueue (frame, false);
+		ghost_remove (p);
+	}
+
+	if (!pml4_set_large_page (pml4, va, kva, true)) {
+		/* Out of memory for the page directory: go on in 4 kB pages,
+		 * which map themselves as they fault. */
+		thp_split (thp);
+		thp_fallback_cnt++;
+		return pml4_set_page (pml4, page->va, page->frame->kva, true);
+	}
+	thp_alloc_cnt++;
+	return true;
+}
+
+/* Splits THP into its 4 kB pages, which stay mapped as they were.  If
+ * there is no memory for the page table that takes, they are unmapped
+ * instead, and map themselves again as they fault.  FRAME_LOCK must be
+ * held. */
+static void
+thp_split (struct thp *thp) {
+	uint64_t *pml4 = thp->owner->pml4;
+	size_t i;
+
+	if (!pml4_split_large_page (pml4, thp->va))
+		pml4_clear_range (pml4, thp->va, THP_PAGES, NULL, NULL);
+	for (i = 0; i < THP_PAGES; i++) {
+		struct page *p = spt_find_page (&thp->owner->spt,
+				(uint8_t *) thp->va + i * PGSIZE);
+
+		if (p != NULL && p->frame != NULL && p->frame->thp == thp)
+			p->frame->thp = NULL;
+	}
+	list_remove (&thp->elem);
+	free (thp);
+	thp_split_cnt++;
+}
+
+/* Splits the huge page that maps VA in SPT, if there is one.
+ * FRAME_LOCK must be held. */
+static void
+thp_split_at (struct supplemental_page_table *spt, void *va) {
+	struct page *page;
+
+	if (((uint64_t) va & LARGE_PGMASK) == 0 || !is_user_vaddr (va))
+		return;
+	page = spt_find_page (spt, va);
+	if (page != NULL && page->frame != NULL && page->frame->thp != NULL)
+		thp_split (page->frame->thp);
+}
+
+/* Maps PAGE, if it is file-backed, to a frame in the file frame cache
+ * that already holds its data, if there is one.  FRAME_LOCK must be
+ * held. */
+static bool
+claim_cached (struct page *page) {
+	struct frame *frame = fcache_find (page);
+
+	if (frame == NULL || frame->io || !file_backed_adopt (page)
+			|| !pml4_set_page (page->owner->pml4, page->va, frame->kva,
+				page->writable))
+		return false;
+	fcache_hit (page);
+	frame_link (frame, page);
+	if (ghost_remove (page))
+		refault_cnt++;
+	return true;
+}
+
+/* Loads PAGE into FRAME, a free frame, without mapping it.  Frees
+ * FRAME and returns false if that fails.  FRAME_LOCK must be held; it
+ * is dropped for any disk read, with FRAME marked busy. */
+static bool
+frame_fill (struct page *page, struct frame *frame) {
+	bool success;
 
 	/* Set links */
-	frame->page = page;
-	page->frame = frame;
+	frame_link (frame, page);
+	frame_io_begin (frame);
+	fcache_add (frame);
+
+	success = swap_in (page, frame->kva);
+	frame_io_end (frame);
+	if (!success)
+		vm_free_frame (frame);
+	return success;
+}
+
+/* Loads PAGE into FRAME, a free frame, and maps it.  FRAME_LOCK must
+ * be held; it is dropped for any disk read. */
+static bool
+claim_frame (struct page *page, struct frame *frame) {
+	if (!frame_fill (page, frame))
+		return false;
+	if (!pml4_set_page (page->owner->pml4, page->va, frame->kva,
+				page->writable && !page->write_protect)) {
+		vm_free_frame (frame);
+		return false;
+	}
+
+	if (ghost_remove (page)) {
+		refault_cnt++;
+		frame_enqueue (frame, true);
+	} else
+		frame_enqueue (frame, false);
+	return true;
+}
 
-	/* TODO: Insert page table entry to map page's VA to frame's PA. */
+/* If PAGE's contents come from a file, whether it is still pending
+ * or already a file-backed page, stores PAGE's offset in the file in
+ * *OFS and returns the file's inode.  Otherwise returns a null
+ * pointer. */
+static struct inode *
+page_file_pos (struct page *page, off_t *ofs) {
+	if (VM_TYPE (page->operations->type) == VM_UNINIT) {
+		struct lazy_load *load = page->uninit.aux;
 
-	return swap_in (page, frame->kva);
+		if (load == NULL)
+			return NULL;
+		*ofs = load->ofs;
+		return file_get_inode (load->file);
+	}
+	if (page_get_type (page) == VM_FILE) {
+		*ofs = page->file.ofs;
+		return file_get_inode (page->file.file);
+	}
+	return NULL;
+}
+
+/* Maps the neighbours of PAGE, which has just been faulted in from
+ * offset OFS of INODE, that belong to the same segment or mapping:
+ * pages of the same type and permissions, not in memory yet, whose
+ * offsets in INODE lie as far from OFS as their addresses do from
+ * PAGE's.  Only free memory is used; this is a guess, not worth
+ * evicting for.  FRAME_LOCK must be held; it is dropped for the reads. */
+static void
+fault_around (struct page *page, struct inode *inode, off_t ofs) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	uint8_t *start = (uint8_t *) ((uint64_t) page->va
+			& ~((uint64_t) FAULT_AROUND * PGSIZE - 1));
+	size_t cnt = FAULT_AROUND;
+	off_t nofs;
+	size_t i;
+
+	if (page->advice == MADV_RANDOM)
+		return;
+	if (page->advice == MADV_SEQUENTIAL) {
+		start = page->va;
+		cnt = FAULT_AHEAD;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		uint8_t *va = start + i * PGSIZE;
+		struct page *next;
+		struct frame *frame;
+
+		if (va == page->va || (next = spt_find_page (spt, va)) == NULL
+				|| next->frame != NULL
+				|| page_get_type (next) != page_get_type (page)
+				|| next->writable != page->writable
+				|| page_file_pos (next, &nofs) != inode
+				|| nofs - ofs != va - (uint8_t *) page->va
+				|| ((frame = fcache_find (next)) != NULL && frame->io))
+			continue;
+		if (claim_cached (next)) {
+			fault_around_cnt++;
+			continue;
+		}
+
+		frame = vm_try_get_frame (next);
+		if (frame == NULL || !claim_frame (next, frame))
+			return;
+		fault_around_cnt++;
+	}
 }
 
 /* Initialize new supplemental page table */
 void
-supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
+supplemental_page_table_init (struct supplemental_page_table *spt) {
+	spt->root = NULL;
+	spt->rss = 0;
+	memset (spt->ws_sample, 0, sizeof spt->ws_sample);
+	spt->ws_epoch = wss_epoch;
+}
+
+/* Links PAGE to FRAME, after any pages that already share it. */
+static void
+frame_link (struct frame *frame, struct page *page) {
+	ASSERT (page->frame == NULL);
+
+	page->frame = frame;
+	page->next_sharer = frame->page;
+	frame->page = page;
+	frame->page_cnt++;
+	page->owner->spt.rss++;
+}
+
+/* Unlinks PAGE from FRAME, which other pages may go on sharing. */
+static void
+frame_unlink (struct frame *frame, struct page *page) {
+	struct page **p;
+
+	ASSERT (page->frame == frame);
+
+	for (p = &frame->page; *p != page; p = &(*p)->next_sharer)
+		ASSERT (*p != NULL);
+	*p = page->next_sharer;
+	page->next_sharer = NULL;
+	page->frame = NULL;
+	frame->page_cnt--;
+	page->owner->spt.rss--;
+}
+
+/* Points PAGE's mapping, if it has one, at KVA, read-only if PAGE is
+ * write-protected, keeping the dirty bit. */
+static void
+page_remap (struct page *page, void *old_kva, void *kva) {
+	uint64_t *pml4 = page->owner->pml4;
+
+	if (pml4_get_page (pml4, page->va) == old_kva) {
+		bool dirty = pml4_is_dirty (pml4, page->va);
+
+		pml4_set_page (pml4, page->va, kva,
+				page->writable && !page->write_protect);
+		pml4_set_dirty (pml4, page->va, dirty);
+	}
+}
+
+/* Maps PAGE, which is in memory, read-only until its next write. */
+static void
+page_write_protect (struct page *page) {
+	if (page->writable && !page->write_protect) {
+		page->write_protect = true;
+		page_remap (page, page->frame->kva, page->frame->kva);
+	}
+}
+
+/* Makes DST, a new page of the running thread, share the frame of
+ * SRC, a loaded anonymous page of the parent, copy-on-write: both are
+ * mapped read-only until they first write.  FRAME_LOCK must be held. */
+static bool
+frame_share (struct page *src, struct page *dst) {
+	struct frame *frame = src->frame;
+
+	if (!dst->uninit.page_initializer (dst, dst->uninit.type, frame->kva)
+			|| !pml4_set_page (dst->owner->pml4, dst->va, frame->kva, false))
+		return false;
+	frame_link (frame, dst);
+	dst->write_protect = dst->writable;
+	page_write_protect (src);
+	cow_share_cnt++;
+	return true;
+}
+
+/* Adds a copy of SRC, a page of the parent's address space, to the
+ * running thread's.  A page that was never loaded, or that is
+ * file-backed, is copied as a pending page with its own lazy_load
+ * record; the child maps a file-backed page from the frame cache, so a
+ * file mapping stays shared with the parent.  A loaded anonymous page
+ * shares its frame with the copy until either writes to it. */
+static bool
+copy_page (struct page *src, void *aux UNUSED) {
+	struct page *dst;
+	bool success;
+
+	bool pending = VM_TYPE (src->operations->type) == VM_UNINIT;
+
+	if (pending || page_get_type (src) == VM_FILE) {
+		struct lazy_load *load = pending ? src->uninit.aux : NULL;
+		struct lazy_load from_file;
+		struct lazy_load *copy = NULL;
+		enum vm_type type = pending ? src->uninit.type : src->file.type;
+		vm_initializer *init = pending ? src->uninit.init : file_lazy_load;
+
+		/* A file page is as good as never loaded: the child maps it
+		 * from the frame cache, or reads it from the file. */
+		if (!pending) {
+			from_file.file = src->file.file;
+			from_file.ofs = src->file.ofs;
+			from_file.read_bytes = src->file.read_bytes;
+			load = &from_file;
+		}
+		if (load != NULL) {
+			copy = malloc (sizeof *copy);
+			if (copy == NULL)
+				return false;
+			*copy = *load;
+			copy->file = file_reopen (load->file);
+			if (copy->file == NULL) {
+				free (copy);
+				return false;
+			}
+		}
+		if (!vm_alloc_page_with_initializer (type, src->va,
+					src->writable, init, copy)) {
+			if (copy != NULL) {
+				file_close (copy->file);
+				free (copy);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	if (!vm_alloc_page (src->anon.type, src->va, src->writable))
+		return false;
+	dst = spt_find_page (&thread_current ()->spt, src->va);
+
+	/* The parent's page may have been evicted: bring it back. */
+	lock_acquire (&frame_lock);
+	page_io_wait (src);
+	success = src->frame != NULL || claim_locked (src);
+	if (success && src->frame->thp != NULL)
+		thp_split (src->frame->thp);
+	if (success)
+		success = frame_share (src, dst);
+	lock_release (&frame_lock);
+	return success;
+}
+
+static uint64_t
+ksm_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct frame, ksm_elem)->ksm_sum;
+}
+
+static bool
+ksm_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct frame, ksm_elem)->ksm_sum
+		< hash_entry (b, struct frame, ksm_elem)->ksm_sum;
+}
+
+/* Takes FRAME out of ksmd's tree, if it is there. */
+static void
+ksm_remove (struct frame *frame) {
+	if (frame->in_ksm_tree) {
+		hash_delete (&ksm_tree, &frame->ksm_elem);
+		frame->in_ksm_tree = false;
+	}
+}
+
+/* Returns true if FRAME holds anonymous pages only, and may be
+ * merged. */
+static bool
+ksm_candidate (struct frame *frame) {
+	struct page *p;
+
+	if (frame->pin_cnt > 0 || frame->readahead || frame->page == NULL
+			|| frame->thp != NULL)
+		return false;
+	for (p = frame->page; p != NULL; p = p->next_sharer)
+		if (page_get_type (p) != VM_ANON)
+			return false;
+	return true;
+}
+
+/* Merges DUP into KEEP, two frames with the same checksum, if their
+ * contents are really the same, and frees DUP.  Returns true if it
+ * did. */
+static bool
+ksm_merge (struct frame *keep, struct frame *dup) {
+	struct page *p;
+
+	/* From here on neither can change under us. */
+	for (p = keep->page; p != NULL; p = p->next_sharer)
+		page_write_protect (p);
+	for (p = dup->page; p != NULL; p = p->next_sharer)
+		page_write_protect (p);
+	if (memcmp (keep->kva, dup->kva, PGSIZE))
+		return false;
+
+	while ((p = dup->page) != NULL) {
+		frame_unlink (dup, p);
+		frame_link (keep, p);
+		page_remap (p, dup->kva, keep->kva);
+		ksm_merge_cnt++;
+	}
+	keep->merged = true;
+	vm_free_frame (dup);
+	return true;
+}
+
+/* Checksums FRAME and merges it with an equal stable frame, if there is
+ * one. */
+static void
+ksm_scan (struct frame *frame) {
+	struct hash_elem *e;
+	struct frame *other;
+	uint64_t sum;
+
+	if (!ksm_candidate (frame))
+		return;
+	sum = hash_bytes (frame->kva, PGSIZE);
+	ksm_scan_cnt++;
+	if (sum != frame->ksm_sum) {
+		/* Changed since the last visit: not worth merging yet. */
+		ksm_remove (frame);
+		frame->ksm_sum = sum;
+		return;
+	}
+	if (frame->in_ksm_tree)
+		return;
+
+	e = hash_insert (&ksm_tree, &frame->ksm_elem);
+	if (e == NULL) {
+		frame->in_ksm_tree = true;
+		return;
+	}
+	other = hash_entry (e, struct frame, ksm_elem);
+	if (!ksm_candidate (other) || !ksm_merge (other, frame)) {
+		/* OTHER changed since it went in: FRAME takes its place. */
+		ksm_remove (other);
+		other->ksm_sum = 0;
+		hash_insert (&ksm_tree, &frame->ksm_elem);
+		frame->in_ksm_tree = true;
+	}
+}
+
+/* The ksmd thread. */
+static void
+ksm_daemon (void *aux UNUSED) {
+	for (;;) {
+		size_t i;
+
+		timer_sleep (KSM_PERIOD);
+		lock_acquire (&frame_lock);
+		for (i = 0; i < KSM_BATCH && !list_empty (&frame_table); i++) {
+			struct frame *frame;
+
+			if (ksm_cursor == list_end (&frame_table))
+				ksm_cursor = list_begin (&frame_table);
+			frame = list_entry (ksm_cursor, struct frame, elem);
+			ksm_cursor = list_next (ksm_cursor);
+			ksm_scan (frame);
+		}
+		lock_release (&frame_lock);
+	}
 }
 
 /* Copy supplemental page table from src to dst */
 bool
-supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
-		struct supplemental_page_table *src UNUSED) {
+supplemental_page_table_copy (struct supplemental_page_table *dst,
+		struct supplemental_page_table *src) {
+	ASSERT (dst == &thread_current ()->spt);
+
+	return spt_for_each (src, NULL, (void *) KERN_BASE, copy_page, NULL);
+}
+
+/* Sets the advice of PAGE to *AUX, an int. */
+static bool
+madvise_set (struct page *page, void *aux) {
+	page->advice = *(int *) aux;
+	return true;
+}
+
+/* Drops PAGE from memory for MADV_DONTNEED.  A file-backed page is
+ * written back if it was written, and read again on its next fault.
+ * An anonymous page loses its contents, frame, and swap, and goes back
+ * to being a pending page of zeros.  FRAME_LOCK must be held. */
+static bool
+madvise_dontneed (struct page *page, void *aux UNUSED) {
+	uint64_t *pml4 = page->owner->pml4;
+	struct frame *frame;
+
+	page_io_wait (page);
+	frame = page->frame;
+	if (frame != NULL && frame->thp != NULL)
+		thp_split (frame->thp);
+
+	if (VM_TYPE (page->operations->type) == VM_UNINIT) {
+		/* Not loaded, but perhaps mapped to the zero page. */
+		pml4_clear_page (pml4, page->va);
+		return true;
+	}
+
+	pml4_clear_page (pml4, page->va);
+	if (page_get_type (page) == VM_FILE && frame != NULL)
+		file_page_write_back (page);
+	pml4_set_dirty (pml4, page->va, false);
+	pml4_set_accessed (pml4, page->va, false);
+	if (frame != NULL) {
+		frame_unlink (frame, page);
+		if (frame->page == NULL)
+			vm_free_frame (frame);
+	}
+	ghost_remove (page);
+
+	if (page_get_type (page) == VM_ANON) {
+		struct thread *owner = page->owner;
+		enum vm_type type = page->anon.type;
+		bool writable = page->writable;
+		uint8_t advice = page->advice;
+
+		destroy (page);
+		uninit_new (page, page->va, NULL, type, NULL, anon_initializer);
+		page->owner = owner;
+		page->writable = writable;
+		page->advice = advice;
+	}
+	dontneed_cnt++;
+	return true;
+}
+
+/* Stores PAGE in *AUX, a struct page *, and stops the walk, if
+ * prefetchd should read it in: if it is not in memory, not all zeros,
+ * and its data is not in the file frame cache either. */
+static bool
+prefetch_find (struct page *page, void *aux) {
+	if (page->frame != NULL || is_zero_fill (page) || fcache_find (page) != NULL)
+		return true;
+	*(struct page **) aux = page;
+	return false;
+}
+
+/* Reads PAGE into a free frame for MADV_WILLNEED, and leaves it to its
+ * next fault to map.  Mapping it here could race with its owner
+ * unmapping it.  Returns false if memory ran out: prefetching is not
+ * worth evicting for.  FRAME_LOCK must be held; it is dropped for the
+ * read. */
+static bool
+prefetch_page (struct page *page) {
+	struct frame *frame = vm_try_get_frame (page);
+
+	if (frame == NULL)
+		return false;
+	if (frame_fill (page, frame)) {
+		frame_enqueue (frame, false);
+		prefetch_cnt++;
+	}
+	return true;
+}
+
+/* The prefetchd thread.  Since FRAME_LOCK is dropped for each read,
+ * it looks up the next page afresh each time, and stops if the
+ * process exits meanwhile. */
+static void
+prefetch_daemon (void *aux UNUSED) {
+	for (;;) {
+		struct prefetch *p;
+
+		sema_down (&prefetch_sema);
+		lock_acquire (&frame_lock);
+		if (!list_empty (&prefetch_queue)) {
+			p = list_entry (list_pop_front (&prefetch_queue),
+					struct prefetch, elem);
+			prefetch_cur = p;
+			while (p->spt != NULL) {
+				struct page *page = NULL;
+
+				spt_for_each (p->spt, p->start, p->end, prefetch_find, &page);
+				if (page == NULL)
+					break;
+				p->start = (uint8_t *) page->va + PGSIZE;
+				if (!prefetch_page (page))
+					break;
+			}
+			prefetch_cur = NULL;
+			free (p);
+		}
+		lock_release (&frame_lock);
+	}
+}
+
+/* Queues [START, END) of the running thread's address space for
+ * prefetchd to read in.  Returns false if out of memory. */
+static bool
+madvise_willneed (void *start, void *end) {
+	struct prefetch *p = malloc (sizeof *p);
+
+	if (p == NULL)
+		return false;
+	p->spt = &thread_current ()->spt;
+	p->start = start;
+	p->end = end;
+
+	lock_acquire (&frame_lock);
+	if (!prefetchd_started)
+		prefetchd_started = thread_create ("prefetchd", PRI_DEFAULT,
+				prefetch_daemon, NULL) != TID_ERROR;
+	list_push_back (&prefetch_queue, &p->elem);
+	lock_release (&frame_lock);
+	sema_up (&prefetch_sema);
+	return true;
+}
+
+/* Does the madvise system call: advises the VM that the pages in
+ * [ADDR, ADDR + LENGTH) of the running thread's address space will be
+ * used as ADVICE says.  Returns 0 on success, or -1 if the range is
+ * not page-aligned user memory or ADVICE is unknown. */
+int
+vm_madvise (void *addr, size_t length, int advice) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *start = addr;
+	uint8_t *end = start + ROUND_UP (length, PGSIZE);
+
+	if (pg_ofs (addr) != 0 || end < start || !is_user_vaddr (addr)
+			|| (end > start && !is_user_vaddr (end - 1)))
+		return -1;
+
+	switch (advice) {
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			spt_for_each (spt, start, end, madvise_set, &advice);
+			return 0;
+		case MADV_WILLNEED:
+			return madvise_willneed (start, end) ? 0 : -1;
+		case MADV_DONTNEED:
+			lock_acquire (&frame_lock);
+			spt_for_each (spt, start, end, madvise_dontneed, NULL);
+			lock_release (&frame_lock);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* Returns true if PAGE is file-backed, counting it in *AUX, a size_t,
+ * and false, stopping the walk, if not. */
+static bool
+msync_check (struct page *page, void *aux) {
+	if (page_get_type (page) != VM_FILE)
+		return false;
+	++*(size_t *) aux;
+	return true;
+}
+
+/* Does the msync system call: writes back the pages in [ADDR, ADDR +
+ * LENGTH) of the running thread's address space that were written
+ * since they were last read or written back.  Returns 0 on success, or
+ * -1 if the range is not page-aligned or not all file-backed. */
+int
+vm_msync (void *addr, size_t length) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *start = addr;
+	uint8_t *end = start + ROUND_UP (length, PGSIZE);
+	size_t page_cnt = 0;
+
+	if (pg_ofs (addr) != 0 || end < start || !is_user_vaddr (addr)
+			|| (end > start && !is_user_vaddr (end - 1))
+			|| !spt_for_each (spt, start, end, msync_check, &page_cnt)
+			|| page_cnt != (size_t) (end - start) / PGSIZE)
+		return -1;
+
+	lock_acquire (&frame_lock);
+	file_write_back_range (spt, start, end);
+	lock_release (&frame_lock);
+	return 0;
+}
+
+/* Loads and maps PAGE unless it is already.  FRAME_LOCK must be
+ * held. */
+static bool
+populate_page (struct page *page, void *aux UNUSED) {
+	if (page->frame != NULL
+			&& pml4_get_page (page->owner->pml4, page->va) == page->frame->kva)
+		return true;
+	if (!claim_locked (page))
+		return false;
+	populate_cnt++;
+	return true;
+}
+
+/* Loads and maps every page of the running thread's address space in
+ * [START, END) that is not in memory, anonymous pages included, so
+ * that the range can be used without a fault.  Pages are loaded in
+ * address order, so a file is read front to back.  Evicts as needed,
+ * like a fault would.  Returns false if some page could not be
+ * loaded; the rest of the range stays lazy then. */
+bool
+vm_populate (void *start, void *end) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	bool success;
+
+	lock_acquire (&frame_lock);
+	success = spt_for_each (spt, start, end, populate_page, NULL);
+	lock_release (&frame_lock);
+	return success;
 }
 
 /* Free the resource hold by the supplemental page table */
 void
-supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
-	/* TODO: Destroy all the supplemental_page_table hold by thread and
-	 * TODO: writeback all the modified contents to the storage. */
+supplemental_page_table_kill (struct supplemental_page_table *spt) {
+	struct list_elem *e, *next;
+
+	/* Nothing may read into it from now on. */
+	lock_acquire (&frame_lock);
+	for (e = list_begin (&prefetch_queue); e != list_end (&prefetch_queue);
+			e = next) {
+		struct prefetch *p = list_entry (e, struct prefetch, elem);
+
+		next = list_next (e);
+		if (p->spt == spt) {
+			list_remove (e);
+			free (p);
+		}
+	}
+	if (prefetch_cur != NULL && prefetch_cur->spt == spt)
+		prefetch_cur->spt = NULL;
+	lock_release (&frame_lock);
+
+	/* Covering the whole tree frees every node, root included. */
+	spt_remove_range (spt, NULL, (void *) SPT_TOP);
+	ASSERT (spt->root == NULL);
 }
@@ -0,0 +1,294 @@
+/* zswap.c: Compressed cache in front of the swap disk.
+ *
+ * An anonymous page that is evicted is first compressed into a pool of
+ * memory set aside from the user pool at boot.  Swapping it back in is
+ * then a decompression instead of eight sector reads.  Only when the
+ * pool is full do its least recently stored pages go on to the swap
+ * disk, and pages that do not compress well go straight there.
+ *
+ * The pool is one contiguous range of pages, divided into chunks of
+ * ZCHUNK bytes that a bitmap hands out; a compressed page takes as
+ * many consecutive chunks as it needs, across page boundaries if need
+ * be.  The codec is a small LZ77 variant: a byte below 0x80 starts a
+ * run of that many plus one literal bytes, and a byte of 0x80 or above
+ * is a match of its low 7 bits plus MIN_MATCH bytes, followed by a
+ * 16-bit little-endian distance back into the output.
+ *
+ * All of this runs with the frame lock held, from the anonymous page
+ * operations, so the static buffers below need no lock of their own. */
+
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* The pool takes one page in ZPOOL_DIV of the user pool. */
+#define ZPOOL_DIV 16
+
+/* Allocation unit within the pool, in bytes. */
+#define ZCHUNK 64
+
+/* A page that does not compress to this size goes to disk. */
+#define ZSWAP_MAX_LEN (PGSIZE * 3 / 4)
+
+/* Codec parameters. */
+#define MAX_LITERALS 0x80
+#define MIN_MATCH 4
+#define MAX_MATCH (0x7f + MIN_MATCH)
+#define HASH_BITS 10
+
+/* A compressed page in the pool. */
+struct zswap_entry {
+	struct list_elem lru_elem;      /* Element in LRU. */
+	struct page *page;              /* The page it holds. */
+	size_t chunk;                   /* First chunk. */
+	size_t len;                     /* Compressed length in bytes. */
+};
+
+static uint8_t *zpool;              /* The pool. */
+static struct bitmap *zpool_map;    /* Used chunks. */
+static struct list lru;             /* Entries, least recently stored first. */
+
+static uint8_t zbuf[PGSIZE];        /* Compression output. */
+static uint8_t wbuf[PGSIZE];        /* Decompressed page for writeback. */
+static uint16_t zhash[1 << HASH_BITS];
+
+/* Statistics. */
+static long long store_cnt;         /* # of pages stored. */
+static long long store_bytes;       /* Compressed bytes of those. */
+static long long reject_cnt;        /* # of pages that did not compress. */
+static long long hit_cnt;           /* # of pages swapped in from the pool. */
+static long long writeback_cnt;     /* # of pages written back to disk. */
+
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max);
+static bool lz_decompress (const uint8_t *src, size_t len, uint8_t *dst);
+static bool make_room (size_t chunk_cnt, size_t *chunk);
+static void entry_free (struct zswap_entry *);
+
+/* Sets aside the pool.  Without it, every page goes to disk. */
+void
+zswap_init (void) {
+	size_t page_cnt = palloc_user_page_cnt () / ZPOOL_DIV;
+
+	list_init (&lru);
+	if (page_cnt == 0)
+		return;
+	zpool = palloc_get_multiple (PAL_USER, page_cnt);
+	zpool_map = bitmap_create (page_cnt * PGSIZE / ZCHUNK);
+	if (zpool == NULL || zpool_map == NULL) {
+		if (zpool != NULL)
+			palloc_free_multiple (zpool, page_cnt);
+		zpool = NULL;
+		bitmap_destroy (zpool_map);
+		zpool_map = NULL;
+	}
+}
+
+/* Prints zswap statistics. */
+void
+zswap_print_stats (void) {
+	long long ratio_x100 = store_bytes ? store_cnt * PGSIZE * 100 / store_bytes : 0;
+
+	printf ("Zswap: %lld pages stored, compression ratio %lld.%02lld, "
+			"%lld rejected, %lld pool hits, %lld written back\n",
+			store_cnt, ratio_x100 / 100, ratio_x100 % 100,
+			reject_cnt, hit_cnt, writeback_cnt);
+}
+
+/* Compresses KVA, the contents of PAGE, into the pool and records the
+ * entry in PAGE.  Writes older entries back to disk if there is no
+ * room.  Returns false if the page does not compress well or no room
+ * could be made; it must then go to disk itself. */
+bool
+zswap_store (struct page *page, const void *kva) {
+	struct zswap_entry *e;
+	size_t len, chunk;
+
+	ASSERT (page->anon.zentry == NULL);
+
+	if (zpool == NULL)
+		return false;
+	len = lz_compress (kva, zbuf, ZSWAP_MAX_LEN);
+	if (len == 0) {
+		reject_cnt++;
+		return false;
+	}
+
+	e = malloc (sizeof *e);
+	if (e == NULL)
+		return false;
+	if (!make_room (DIV_ROUND_UP (len, ZCHUNK), &chunk)) {
+		free (e);
+		return false;
+	}
+	memcpy (zpool + chunk * ZCHUNK, zbuf, len);
+	e->page = page;
+	e->chunk = chunk;
+	e->len = len;
+	list_push_back (&lru, &e->lru_elem);
+	page->anon.zentry = e;
+
+	store_cnt++;
+	store_bytes += len;
+	return true;
+}
+
+/* Decompresses PAGE from the pool into KVA and frees its entry. */
+void
+zswap_load (struct page *page, void *kva) {
+	struct zswap_entry *e = page->anon.zentry;
+
+	ASSERT (e != NULL);
+
+	if (!lz_decompress (zpool + e->chunk * ZCHUNK, e->len, kva))
+		PANIC ("zswap: corrupt entry for page %p", page->va);
+	entry_free (e);
+	hit_cnt++;
+}
+
+/* Frees PAGE's entry in the pool, if it has one. */
+void
+zswap_drop (struct page *page) {
+	if (page->anon.zentry != NULL)
+		entry_free (page->anon.zentry);
+}
+
+/* Finds CHUNK_CNT free consecutive chunks, writing the least recently
+ * stored pages back to disk until there are, and marks them used.
+ * Stores the first in *CHUNK and returns true on success. */
+static bool
+make_room (size_t chunk_cnt, size_t *chunk) {
+	for (;;) {
+		struct zswap_entry *e;
+
+		*chunk = bitmap_scan_and_flip (zpool_map, 0, chunk_cnt, false);
+		if (*chunk != BITMAP_ERROR)
+			return true;
+		if (list_empty (&lru))
+			return false;
+
+		e = list_entry (list_front (&lru), struct zswap_entry, lru_elem);
+		if (!lz_decompress (zpool + e->chunk * ZCHUNK, e->len, wbuf))
+			PANIC ("zswap: corrupt entry for page %p", e->page->va);
+		if (!anon_swap_write (e->page, wbuf))
+			return false;
+		entry_free (e);
+		writeback_cnt++;
+	}
+}
+
+/* Frees entry E and its chunks, and unlinks it from its page. */
+static void
+entry_free (struct zswap_entry *e) {
+	bitmap_set_multiple (zpool_map, e->chunk, DIV_ROUND_UP (e->len, ZCHUNK),
+			false);
+	list_remove (&e->lru_elem);
+	e->page->anon.zentry = NULL;
+	free (e);
+}
+
+static inline uint32_t
+read32 (const uint8_t *p) {
+	uint32_t v;
+	memcpy (&v, p, sizeof v);
+	return v;
+}
+
+/* Appends the CNT literal bytes at SRC to DST, which already holds
+ * *OP of at most DST_MAX bytes.  Returns false if they do not fit. */
+static bool
+put_literals (const uint8_t *src, size_t cnt, uint8_t *dst, size_t *op,
+		size_t dst_max) {
+	while (cnt > 0) {
+		size_t run = cnt < MAX_LITERALS ? cnt : MAX_LITERALS;
+
+		if (*op + 1 + run > dst_max)
+			return false;
+		dst[(*op)++] = run - 1;
+		memcpy (dst + *op, src, run);
+		*op += run;
+		src += run;
+		cnt -= run;
+	}
+	return true;
+}
+
+/* Compresses the page at SRC into DST.  Returns the compressed length,
+ * or 0 if it would exceed DST_MAX bytes. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max) {
+	size_t ip = 0, op = 0, lit = 0;
+
+	memset (zhash, 0, sizeof zhash);
+	while (ip + MIN_MATCH <= PGSIZE) {
+		uint32_t seq = read32 (src + ip);
+		size_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+		size_t cand = zhash[h];
+
+		/* Positions are stored plus one, so that 0 means empty. */
+		zhash[h] = ip + 1;
+		if (cand != 0 && read32 (src + cand - 1) == seq) {
+			size_t ref = cand - 1;
+			size_t len = MIN_MATCH;
+
+			while (ip + len < PGSIZE && len < MAX_MATCH
+					&& src[ref + len] == src[ip + len])
+				len++;
+			if (!put_literals (src + lit, ip - lit, dst, &op, dst_max)
+					|| op + 3 > dst_max)
+				return 0;
+			dst[op++] = 0x80 | (len - MIN_MATCH);
+			dst[op++] = (ip - ref) & 0xff;
+			dst[op++] = (ip - ref) >> 8;
+			ip += len;
+			lit = ip;
+		} else
+			ip++;
+	}
+	if (!put_literals (src + lit, PGSIZE - lit, dst, &op, dst_max))
+		return 0;
+	return op;
+}
+
+/* Decompresses the LEN bytes at SRC into the page at DST.  Returns
+ * false if they do not decode to exactly one page. */
+static bool
+lz_decompress (const uint8_t *src, size_t len, uint8_t *dst) {
+	size_t ip = 0, op = 0;
+
+	while (ip < len) {
+		uint8_t c = src[ip++];
+
+		if (c < 0x80) {
+			size_t run = c + 1;
+
+			if (ip + run > len || op + run > PGSIZE)
+				return false;
+			memcpy (dst + op, src + ip, run);
+			ip += run;
+			op += run;
+		} else {
+			size_t mlen = (c & 0x7f) + MIN_MATCH;
+			size_t dist;
+
+			if (ip + 2 > len)
+				return false;
+			dist = src[ip] | (src[ip + 1] << 8);
+			ip += 2;
+			if (dist == 0 || dist > op || op + mlen > PGSIZE)
+				return false;
+			/* Byte by byte: the source may overlap what we write. */
+			for (; mlen > 0; mlen--, op++)
+				dst[op] = dst[op - dist];
+		}
+	}
+	return op == PGSIZE;
+}